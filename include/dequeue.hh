@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <iterator>
@@ -9,6 +10,7 @@
 #include <queue>
 #include <shared_mutex>
 #include <string>
+#include <utility>
 #include <variant>
 
 #include <libpq-fe.h>
@@ -23,6 +25,7 @@ using std::condition_variable_any;
 using std::map;
 using std::monostate;
 using std::optional;
+using std::pair;
 using std::queue;
 using std::shared_mutex;
 using std::shared_ptr;
@@ -80,14 +83,30 @@ struct NoMessages {
   string msg = "unexpectedly got no messages even though poll was ready";
 };
 
+struct FetchingPayloads {
+  string pg_msg;
+  FetchingPayloads(string pg_msg) : pg_msg(pg_msg) {}
+  string msg() { return "fetching event payloads: " + pg_msg; }
+};
+
+struct ConnectionLost {
+  string reason;
+  ConnectionLost(string reason) : reason(reason) {}
+  string msg() { return "lost postgres connection: " + reason; }
+};
+
 typedef variant<PollingError, ConsumingInput, JsonDecodeError, ParsingEvent,
-                WrongChannel, EscapingChannel, NoMessages>
+                WrongChannel, EscapingChannel, NoMessages, ConnectionLost,
+                FetchingPayloads>
     Error;
 
 string err_msg(Error e);
 
 typedef variant<Error, event::Event> ListenResult;
 
+/// An event as notified, without its payload.
+typedef variant<Error, event::Fields<json>> Notified;
+
 struct NonEmptyListenResults {
   ListenResult head;
   std::queue<ListenResult> tail;
@@ -100,7 +119,17 @@ struct NonEmptyListenResults {
   }
 };
 
-NonEmptyListenResults await_events(PGconn *conn, string const &channel_ident);
+/// Waits for events on conn, for at most timeout_ms unless it is negative.
+NonEmptyListenResults await_events(PGconn *conn, string const &channel_ident,
+                                   int timeout_ms = -1);
+
+std::queue<Notified>
+parse_notifications(vector<shared_ptr<PGnotify>> const &notifications,
+                    string const &on_channel);
+
+/// Fetches the payloads of notified in a single query, and parses the
+/// events.
+std::queue<ListenResult> hydrate(PGconn *conn, std::queue<Notified> notified);
 
 struct QueueState {
   PGconn *conn;
@@ -111,19 +140,51 @@ struct QueueState {
 
   const string channel_ident;
 
+  /// The job whose events these are, if the channel is its own. Its events
+  /// are then read back from the database after losing the connection.
+  const optional<Uuid> job;
+
+  /// How long to wait for an event before probing the connection, and for
+  /// the probe's answer before catching up on a new one. Forever if unset.
+  const optional<std::chrono::steady_clock::duration> timeout;
+
+  /// The seq of the last event in curr. Events up to it are dropped, as
+  /// the same event can arrive both in a seed and notified.
+  int64_t seq;
+
   QueueState(PGconn *conn, string const &channel_ident,
-             NonEmptyListenResults events)
-      : conn(conn), curr(std::make_shared<ListenResult>(events.head)),
-        queue(std::make_unique<std::queue<ListenResult>>(events.tail)),
-        channel_ident(channel_ident){};
+             optional<Uuid> const &job,
+             optional<std::chrono::steady_clock::duration> const &timeout,
+             std::queue<ListenResult> &&seed)
+      : conn(conn), curr(),
+        queue(std::make_unique<std::queue<ListenResult>>(std::move(seed))),
+        channel_ident(channel_ident), job(job), timeout(timeout), seq(0){};
+
+  /// Moves curr on to the next event not seen yet, waiting for one if need
+  /// be.
+  void advance();
+
+private:
+  /// Reconnects, listens again and returns the events of job after seq.
+  variant<string, std::queue<ListenResult>> catch_up();
 };
 
 struct Events {
   shared_ptr<PGconn> conn;
   const string channel_ident;
+  const optional<Uuid> job;
+  const optional<std::chrono::steady_clock::duration> timeout;
 
   Events(shared_ptr<PGconn> &&conn, string const &channel_ident)
-      : conn(conn), channel_ident(channel_ident) {}
+      : conn(conn), channel_ident(channel_ident), job(), timeout() {}
+
+  /// Listens on the channel of job, on a connection made by
+  /// postgres::connect. After timeout without events the connection is
+  /// probed, and replaced if the probe goes unanswered as long again.
+  Events(shared_ptr<PGconn> &&conn, Uuid const &job,
+         std::chrono::steady_clock::duration timeout)
+      : conn(conn), channel_ident(job.to_string()), job(job),
+        timeout(timeout) {}
 
   struct Iterator {
     using iterator_category = std::input_iterator_tag;
@@ -140,21 +201,7 @@ struct Events {
     pointer operator->() { return state; }
 
     Iterator &operator++() {
-      if (this->state->queue->empty()) {
-        auto next = await_events(this->state->conn, this->state->channel_ident);
-
-        this->state->curr = std::make_shared<ListenResult>(next.head);
-
-        this->state->queue =
-            std::make_unique<std::queue<ListenResult>>(next.tail);
-      }
-
-      else {
-        this->state->curr =
-            std::make_shared<ListenResult>(this->state->queue->front());
-
-        this->state->queue->pop();
-      }
+      this->state->advance();
 
       return *this;
     };
@@ -171,36 +218,32 @@ struct Events {
     };
   };
 
+  /// Starts with the events in seed, e.g. from get_events in the
+  /// transaction that listened.
   Iterator begin(std::queue<ListenResult> &&seed) {
-    auto init = seed.empty()
-                    ? await_events(this->conn.get(), this->channel_ident)
-                    : NonEmptyListenResults{
-                          .head = std::move(seed.front()),
-                          .tail = {},
-                      };
-
-    if (!seed.empty()) {
-      seed.pop();
+    auto state = new QueueState(this->conn.get(), this->channel_ident,
+                                this->job, this->timeout, std::move(seed));
 
-      init.tail = std::move(seed);
-    }
+    state->advance();
 
-    return Events::Iterator(
-        new QueueState(this->conn.get(), this->channel_ident, init));
+    return Events::Iterator(state);
   }
 
-  Iterator begin() {
-    auto init = await_events(this->conn.get(), this->channel_ident);
-
-    return Events::Iterator(
-        new QueueState(this->conn.get(), this->channel_ident, init));
-  }
+  Iterator begin() { return begin(std::queue<ListenResult>()); }
 };
 
+variant<string, Events> listen_channel(shared_ptr<PGconn> conn,
+                                       const string &channel_ident);
+
 variant<string, Events>
 listen_channel(postgres::ConnectionParams const &conn_params,
                const string &channel_ident);
 
+/// Listens on a pooled connection, which stops listening before going back
+/// to the pool. Once a reactor watched it, it is closed instead.
+variant<string, Events> listen_channel(postgres::Pool &pool,
+                                       const string &channel_ident);
+
 template <typename T> struct Buffer {
 private:
   std::queue<T> buf;
@@ -243,7 +286,19 @@ public:
 
 typedef variant<string, std::queue<ListenResult>> GetEventsResult;
 
-GetEventsResult get_events(PGconn *conn, Uuid const &job);
+/// Takes two parameters, the job and the seq to read its events after.
+extern postgres::Prepared const select_events;
+
+/// The events of job after the one numbered after, in order.
+GetEventsResult get_events(PGconn *conn, Uuid const &job, int64_t after = 0);
+
+/// get_events for every job in cursors, after the seq it maps to, in one
+/// query.
+GetEventsResult get_missed_events(PGconn *conn,
+                                  map<Uuid, int64_t> const &cursors);
+
+/// Reads the results of select_events.
+GetEventsResult events_of(PGresult *res);
 
 } // namespace dequeue
 } // namespace remote_build
@@ -2,6 +2,7 @@
 
 #include <libpq-fe.h>
 
+#include <memory>
 #include <queue>
 #include <string>
 #include <variant>
@@ -11,6 +12,7 @@
 #include <uuid.hh>
 
 using std::monostate;
+using std::shared_ptr;
 using std::string;
 using std::variant;
 
@@ -22,7 +24,17 @@ namespace remote_build {
 namespace enqueue {
 namespace postgres {
 
-variant<string, Uuid> enqueue_job(PGconn *conn, BuildRequirements const &reqs);
+/// A job just enqueued, with the events it had by the time conn started
+/// listening for more.
+struct Enqueued {
+  Uuid job;
+  std::queue<ListenResult> seed;
+};
+
+/// Enqueues a job, subscribes to and listens on its channel and reads its
+/// events in a single round trip.
+variant<string, Enqueued> enqueue_and_listen(PGconn *conn,
+                                             BuildRequirements const &reqs);
 
 variant<string, monostate> cancel_job(PGconn *conn, Uuid const &job);
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <variant>
 
@@ -23,6 +24,9 @@ namespace remote_build {
 namespace event {
 
 template <class T> struct Fields {
+  /// Increases with every event inserted, unlike ts, which all the events
+  /// of a transaction share.
+  int64_t seq;
   string ts;
   string name;
   Uuid job;
@@ -31,22 +35,28 @@ template <class T> struct Fields {
   Fields(const Fields<T> &fields) = default;
 
   Fields(const Fields<json> fields, const T &payload)
-      : ts(fields.ts), name(fields.name), job(fields.job), payload(payload) {}
+      : seq(fields.seq), ts(fields.ts), name(fields.name), job(fields.job),
+        payload(payload) {}
 
+  /// Notifications leave out the payload, which is then null.
   Fields(json const &j)
-      : ts(j["ts"]), name(j["name"]), job(Uuid(j["job"])),
-        payload(j["payload"]) {}
+      : seq(j["seq"]), ts(j["ts"]), name(j["name"]), job(Uuid(j["job"])),
+        payload(j.value("payload", json())) {}
 
-  Fields(string const &ts, string const &name, string const &job,
+  Fields(int64_t seq, string const &ts, string const &name, Uuid const &job,
          const T &payload)
-      : ts(ts), name(name), job(Uuid(job)), payload(payload) {}
+      : seq(seq), ts(ts), name(name), job(job), payload(payload) {}
 
+  /// Reads a row of get_events in binary format.
   static postgres::FromRowResult<Fields<json>>
-  from_row(std::array<optional<string>, 4> tup) {
-    auto [ts, name, job, payload] = tup;
+  from_row(std::array<optional<string>, 5> tup) {
+    auto [seq, ts, name, job, payload] = tup;
 
     vector<string> errs;
 
+    if (!seq.has_value())
+      errs.push_back("seq was null");
+
     if (!ts.has_value())
       errs.push_back("ts was null");
 
@@ -63,13 +73,30 @@ template <class T> struct Fields {
       return postgres::FromRowResult<Fields>(
           postgres::FromRowError(concat_strings::sep(errs, ", ")));
 
-    try {
-      return postgres::FromRowResult<Fields>(
-          Fields(*ts, *name, *job, json::parse(*payload)));
-    } catch (json::exception &e) {
-      return postgres::FromRowError(
-          nix::fmt("parsing payload: %s. got %s", e.what(), *payload));
-    }
+    auto seq_res = postgres::int8_value(*seq);
+
+    if (std::holds_alternative<string>(seq_res))
+      return postgres::FromRowError("seq: " + get<string>(seq_res));
+
+    auto ts_res = postgres::timestamptz_value(*ts);
+
+    if (std::holds_alternative<string>(ts_res))
+      return postgres::FromRowError("ts: " + get<string>(ts_res));
+
+    auto job_res = postgres::uuid_value(*job);
+
+    if (std::holds_alternative<string>(job_res))
+      return postgres::FromRowError("job: " + get<string>(job_res));
+
+    auto payload_res = postgres::jsonb_value(*payload);
+
+    if (std::holds_alternative<string>(payload_res))
+      return postgres::FromRowError("payload: " + get<string>(payload_res));
+
+    return postgres::FromRowResult<Fields>(
+        Fields(get<int64_t>(seq_res),
+               postgres::show_timestamp(get<postgres::Timestamp>(ts_res)),
+               *name, get<Uuid>(job_res), get<json>(payload_res)));
   }
 };
 
@@ -113,22 +140,41 @@ struct BuildError {
 
 using Fail = Fields<BuildError>;
 
+struct S {};
+
+using Succeed = Fields<S>;
+
 typedef variant<Start, Cancel, NoMachineAvailable, Accept, AddInputsAndOutputs,
-                Fail>
+                Fail, Succeed>
     Event;
 
 typedef variant<string, Event> ParseResult;
 
 ParseResult parse(Fields<json> const &fields);
 
-postgres::FromRowResult<Event> from_row(std::array<optional<string>, 4> tup);
+/// Reads a notification, which holds either a single event or an array of
+/// the events inserted by one statement. Throws like Fields(json).
+vector<Fields<json>> batch(json const &j);
+
+postgres::FromRowResult<Event> from_row(std::array<optional<string>, 5> tup);
 
 Fields<monostate> plain(Event const &event);
 
-template <class T> struct OrdByTimeAsc {
-  bool comp(Fields<T> const &a, Fields<T> const &b) { return a.ts < b.ts; }
+/// Orders events as they were inserted. Their ts strings do not sort, the
+/// offset of the session that showed them is part of them.
+template <class T> struct OrdBySeqAsc {
+  bool comp(Fields<T> const &a, Fields<T> const &b) { return a.seq < b.seq; }
 
-  bool equiv(Fields<T> const &a, Fields<T> const &b) { return a.ts == b.ts; }
+  bool equiv(Fields<T> const &a, Fields<T> const &b) {
+    return a.seq == b.seq;
+  }
+};
+
+/// Comparator for a std::priority_queue that keeps the oldest event on top.
+template <class T> struct OldestFirst {
+  bool operator()(Fields<T> const &a, Fields<T> const &b) const {
+    return OrdBySeqAsc<T>().comp(b, a);
+  }
 };
 
 } // namespace event
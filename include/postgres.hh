@@ -1,5 +1,7 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <optional>
 #include <set>
@@ -12,12 +14,14 @@
 #include <libpq-fe.h>
 
 #include <nix/store-api.hh>
+#include <nix/sync.hh>
 #include <nix/util.hh>
 
 #include <concat-strings.hh>
 #include <uuid.hh>
 
 using nix::overloaded;
+using nix::Sync;
 using std::monostate;
 using std::optional;
 using std::set;
@@ -41,6 +45,56 @@ struct ConnectionParams {
 
 variant<string, shared_ptr<PGconn>> connect(ConnectionParams const &params);
 
+/// Reopens a broken connection made by connect, with the same settings.
+/// Whatever it listened to and prepared is lost.
+variant<string, monostate> reconnect(PGconn *conn);
+
+/// A bounded set of connections shared between threads. Connections are
+/// opened on demand, checked before being handed out again and replaced
+/// when broken.
+struct Pool {
+private:
+  struct Idle {
+    shared_ptr<PGconn> conn;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  struct Conns {
+    vector<Idle> idle;
+    /// Connections idle or checked out.
+    size_t open = 0;
+    /// Checked out connections to close rather than take back.
+    set<PGconn *> discarded;
+  };
+
+  Sync<Conns> conns;
+  std::condition_variable returned;
+
+  void put(shared_ptr<PGconn> conn);
+
+public:
+  ConnectionParams const params;
+  size_t const max_size;
+  /// How long a connection may sit idle before it is pinged on checkout.
+  std::chrono::steady_clock::duration const check_after;
+
+  Pool(ConnectionParams const &params, size_t max_size,
+       std::chrono::steady_clock::duration check_after =
+           std::chrono::seconds(30))
+      : conns(), returned(), params(params), max_size(max_size),
+        check_after(check_after) {}
+
+  /// Checks out a connection, waiting while max_size are in use. It goes
+  /// back to the pool when the last copy of the pointer is dropped, unless
+  /// it was left broken, non-blocking, in pipeline mode or inside a
+  /// transaction.
+  variant<string, shared_ptr<PGconn>> get();
+
+  /// Has the checked out conn closed instead of taken back, e.g. when a
+  /// query on it may still be in flight.
+  void discard(PGconn *conn);
+};
+
 string show_conn_string(PGconn *conn);
 
 shared_ptr<PGresult> exec(PGconn *conn, string const &stmt);
@@ -48,6 +102,82 @@ shared_ptr<PGresult> exec(PGconn *conn, string const &stmt);
 shared_ptr<PGresult> exec_params(PGconn *conn, string const &stmt, int n_params,
                                  char **params);
 
+namespace oid {
+Oid const int8 = 20;
+Oid const int4 = 23;
+Oid const int8_array = 1016;
+Oid const text = 25;
+Oid const timestamptz = 1184;
+Oid const text_array = 1009;
+Oid const uuid = 2950;
+Oid const uuid_array = 2951;
+} // namespace oid
+
+/// A parameter in postgres' binary format.
+struct Param {
+  Oid type;
+  string value;
+};
+
+Param int4_param(int32_t n);
+
+Param int8_param(int64_t n);
+
+Param uuid_param(Uuid const &u);
+
+Param text_param(string const &s);
+
+Param text_array_param(vector<string> const &v);
+
+Param text_array_param(set<string> const &v);
+
+Param text_array_param(nix::StorePathSet const &s);
+
+Param uuid_array_param(vector<Uuid> const &v);
+
+Param int8_array_param(vector<int64_t> const &v);
+
+/// A statement parsed and planned once per connection under name. Its
+/// parameter types are those of the first params it runs with.
+struct Prepared {
+  string const name;
+  string const stmt;
+};
+
+/// Runs stmt, preparing it first if conn has not yet, and returns the
+/// results in binary format. Connections opened by connect remember what
+/// they prepared until they are reset; any other connection sends the
+/// statement every time.
+shared_ptr<PGresult> exec_prepared(PGconn *conn, Prepared const &stmt,
+                                   vector<Param> const &params);
+
+/// A statement sent as part of a pipeline.
+struct Query {
+  string stmt;
+  vector<Param> params;
+};
+
+/// Sends queries in libpq's pipeline mode and waits for all their results
+/// at once, taking a single round trip. They run in one transaction, so
+/// either all of them succeed or none of them does.
+variant<string, vector<shared_ptr<PGresult>>>
+exec_pipeline(PGconn *conn, vector<Query> const &queries);
+
+typedef std::chrono::system_clock::time_point Timestamp;
+
+variant<string, int64_t> int8_value(string const &bytes);
+
+variant<string, Uuid> uuid_value(string const &bytes);
+
+variant<string, Timestamp> timestamptz_value(string const &bytes);
+
+variant<string, vector<string>> text_array_value(string const &bytes);
+
+variant<string, json> jsonb_value(string const &bytes);
+
+/// Shows ts the way row_to_json does in a UTC session.
+string show_timestamp(Timestamp ts);
+
 variant<string, shared_ptr<char>> escape_identifier(PGconn *conn,
                                                     string const &ident);
 
@@ -59,15 +189,6 @@ string err_msg(PGresult *res, string const &additional_msg);
 
 string err_msg(PGresult *res);
 
-string to_sql_array(vector<string> const &v);
-
-string to_sql_array(set<string> const &v);
-
-string to_sql_array(nix::StorePathSet const &s);
-
-// FIXME: Not a nice escaping mechanism
-string escape_uuid(Uuid const &u);
-
 struct PollingConnectionClosed {
   string msg = "postgres connection was closed";
 };
@@ -79,7 +200,7 @@ struct PollingFailed {
 };
 
 struct PollingTimedOut {
-  string msg = "polling postgres socket timed out unexpectedly";
+  string msg = "polling postgres socket timed out";
 };
 
 struct PollingUnexpectedNumResults {
@@ -114,7 +235,14 @@ typedef variant<PollingError, monostate> PollingResult;
 
 string err_msg(PollingError err);
 
-PollingResult poll_socket_ready(PGconn *conn);
+/// Waits for conn's socket to become readable, for at most timeout_ms
+/// unless it is negative.
+PollingResult poll_socket_ready(PGconn *conn, int timeout_ms = -1);
+
+/// Whether a trivial query on the blocking conn is answered within timeout.
+/// Notifications arriving meanwhile are kept for collect_notifications. If
+/// not, the query may still be in flight and conn must be reset.
+bool probe(PGconn *conn, std::chrono::steady_clock::duration timeout);
 
 vector<shared_ptr<PGnotify>> collect_notifications(PGconn *conn);
 
@@ -153,7 +281,8 @@ FromRowResults<T> collect_tuples(PGresult *res, FromRow<T, N> f) {
     for (int j = 0; j < n_fields; j++) {
       tup[j] = (PQgetisnull(res, i, j) == 1)
                    ? std::nullopt
-                   : std::make_optional<string>(PQgetvalue(res, i, j));
+                   : std::make_optional<string>(PQgetvalue(res, i, j),
+                                                PQgetlength(res, i, j));
     }
     results.emplace_back(f(tup));
   }
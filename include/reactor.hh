@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <libpq-fe.h>
+
+#include <nix/sync.hh>
+
+using std::map;
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+using nix::Sync;
+
+namespace remote_build {
+namespace reactor {
+
+typedef std::chrono::steady_clock Clock;
+
+typedef std::function<void(vector<shared_ptr<PGnotify>> const &)> OnNotify;
+
+typedef std::function<void(string const &)> OnError;
+
+/// Waits on any number of libpq connections from a single thread with
+/// epoll, instead of one thread blocked in poll per connection.
+///
+/// Watched connections are switched to non-blocking mode. A connection
+/// quiet for longer than its timeout is pinged, and given up on with
+/// on_error if the ping goes unanswered for as long again. Callbacks run
+/// on the reactor thread and must hand work off rather than block.
+struct Reactor {
+private:
+  struct Watch {
+    shared_ptr<PGconn> conn;
+    Clock::duration timeout;
+    OnNotify on_notify;
+    OnError on_error;
+    Clock::time_point last_heard;
+    optional<Clock::time_point> pinged;
+  };
+
+  int epoll_fd;
+  /// Wakes run() when watches change
+  int wake_fd;
+  Sync<map<int, Watch>> watches;
+
+  void handle_ready(int fd, uint32_t events);
+
+  void handle_timeouts();
+
+  optional<Clock::time_point> next_deadline();
+
+  void drop(int fd, string const &msg);
+
+public:
+  Reactor();
+
+  ~Reactor();
+
+  Reactor(Reactor const &) = delete;
+
+  /// Starts delivering the notifications received on conn. Returns an error
+  /// if conn cannot be watched.
+  optional<string> watch(shared_ptr<PGconn> conn, Clock::duration timeout,
+                         OnNotify on_notify, OnError on_error);
+
+  /// The reactor thread's body. Never returns.
+  void run();
+};
+
+} // namespace reactor
+} // namespace remote_build
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nix/machines.hh>
+
+#include <job.hh>
+
+using std::map;
+using std::optional;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace remote_build {
+namespace queue {
+namespace capabilities {
+
+const size_t MAX_FEATURES = 128;
+
+typedef std::bitset<MAX_FEATURES> Features;
+
+/// Assigns every feature name a configured machine mentions its own bit.
+struct Interner {
+  map<string, size_t> bits;
+
+  Interner() : bits() {}
+
+  /// Throws nix::Error once more than MAX_FEATURES names are interned.
+  Features intern(set<string> const &features);
+
+  /// std::nullopt if some feature is unknown to every machine.
+  optional<Features> lookup(set<string> const &features) const;
+};
+
+/// What a machine can build, with features interned.
+struct Capability {
+  vector<string> systems;
+  Features supported;
+  Features mandatory;
+
+  /// Whether a job for system with required features may run here: the
+  /// system matches (or is builtin), every required feature is supported
+  /// and every mandatory feature is required.
+  bool satisfies(string const &system, Features const &required) const;
+
+  bool operator==(Capability const &other) const {
+    return systems == other.systems && supported == other.supported &&
+           mandatory == other.mandatory;
+  }
+};
+
+/// An idle slot able to build some job.
+struct Idle {
+  size_t slot;
+  /// Features the slot's machine supports that the job does not need.
+  size_t unused_features;
+};
+
+/// Maps a job's (system, features) to the slots that can build it
+/// and tracks which of those slots are idle.
+///
+/// Slots are identified by their position in State::ready and grouped by
+/// the machine they run on.
+struct Index {
+private:
+  struct Class {
+    Capability cap;
+    /// Idle slots of each machine
+    map<size_t, set<size_t>> idle;
+  };
+
+  struct Key {
+    string system;
+    Features required;
+
+    bool operator==(Key const &other) const {
+      return system == other.system && required == other.required;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(Key const &k) const {
+      return std::hash<string>()(k.system) ^
+             (std::hash<Features>()(k.required) << 1);
+    }
+  };
+
+  Interner interner;
+  vector<Class> classes;
+  /// Class of each slot
+  vector<size_t> slot_class;
+  /// Machine of each slot
+  vector<size_t> slot_machine;
+  /// Classes able to build each (system, features) seen so far.
+  std::unordered_map<Key, vector<size_t>, KeyHash> matches;
+
+  vector<size_t> const *capable(job::Job const &job);
+
+public:
+  Index()
+      : interner(), classes(), slot_class(), slot_machine(), matches() {}
+
+  /// Registers the next slot id, initially idle, running on machine.
+  /// machine_id groups the slots of one machine.
+  size_t add(nix::Machine const &machine, size_t machine_id);
+
+  /// Whether any slot can ever build job.
+  bool can_build(job::Job const &job);
+
+  /// Whether slot can build job.
+  bool can_build(size_t slot, job::Job const &job);
+
+  /// One idle slot per machine able to build job.
+  vector<Idle> candidates(job::Job const &job);
+
+  /// Marks an idle slot busy.
+  void take(size_t slot);
+
+  void set_idle(size_t slot);
+
+  /// How many slots are idle, whatever they can build.
+  size_t idle_slots() const;
+};
+
+} // namespace capabilities
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <nix/store-api.hh>
+#include <nix/sync.hh>
+
+#include <remote-build-queue/nar-cache.hh>
+
+using nix::Sync;
+
+namespace remote_build {
+namespace queue {
+namespace copy {
+
+/// Sends one path to remote, whose references must already be valid there.
+/// Takes the NAR from cache when some other machine was sent the same path
+/// recently, and fills cache otherwise.
+void send_path(nix::Store &local, nix::Store &remote,
+               nix::StorePath const &path, Sync<nar_cache::NarCache> &cache);
+
+} // namespace copy
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+#include <nix/store-api.hh>
+
+#include <remote-build-queue/valid-paths.hh>
+
+using std::map;
+
+namespace remote_build {
+namespace queue {
+namespace locality {
+
+/// NAR size of every path in a job's input closure.
+typedef map<nix::StorePath, uint64_t> Closure;
+
+/// The closure of a derivation's inputs that is already valid in the
+/// local store. Outputs of input derivations that are not built yet are
+/// left out. Throws nix::Error if the derivation cannot be read.
+Closure input_closure(nix::Store &local, nix::StorePath const &drv_path);
+
+uint64_t total_bytes(Closure const &closure);
+
+/// Bytes of closure that would have to be copied to a machine already
+/// holding valid.
+uint64_t missing_bytes(Closure const &closure,
+                       valid_paths::ValidPaths const &valid);
+
+} // namespace locality
+} // namespace queue
+} // namespace remote_build
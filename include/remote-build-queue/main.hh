@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <set>
@@ -8,19 +10,27 @@
 #include <thread>
 #include <utility>
 
+#include <nix/store-api.hh>
 #include <nix/sync.hh>
 #include <nix/util.hh>
 
 #include <dequeue.hh>
 #include <event.hh>
 #include <postgres.hh>
+#include <reactor.hh>
+#include <remote-build-queue/capabilities.hh>
+#include <remote-build-queue/locality.hh>
 #include <remote-build-queue/machines.hh>
+#include <remote-build-queue/nar-cache.hh>
+#include <remote-build-queue/routes.hh>
+#include <remote-build-queue/scheduler.hh>
+#include <remote-build-queue/transfer.hh>
+#include <remote-build-queue/wait-queue.hh>
 #include <remote-build-queue/worker.hh>
 
 using std::condition_variable;
 using std::optional;
 using std::pair;
-using std::priority_queue;
 using std::set;
 using std::shared_ptr;
 using std::string;
@@ -33,59 +43,160 @@ using nix::Sync;
 using remote_build::dequeue::Buffer;
 using remote_build::dequeue::Events;
 using remote_build::dequeue::ListenResult;
+using remote_build::dequeue::Notified;
 using remote_build::event::Event;
+using remote_build::queue::wait_queue::WaitQueue;
+using remote_build::queue::worker::Builder;
 using remote_build::queue::worker::Worker;
 
 namespace remote_build {
 namespace queue {
 
-typedef priority_queue<event::Start, std::vector<event::Start>,
-                       event::OrdByTimeAsc<job::Job>>
-    WaitQueue;
-
 typedef vector<shared_ptr<Worker>> Slots;
 
+typedef vector<shared_ptr<Builder>> Builders;
+
+/// Daemon settings taken from the command line.
+struct Options {
+  scheduler::Score score;
+  /// How long a path copied to a machine is assumed to stay valid there.
+  valid_paths::Clock::duration valid_path_ttl;
+  size_t nar_cache_bytes;
+  string nar_cache_compression;
+  unsigned int max_transfers;
+  unsigned int max_machine_transfers;
+  /// Whether to compress the ssh streams to machines.
+  bool compress_transfers;
+  unsigned int max_db_connections;
+  /// How long the listening connection may stay quiet before it is pinged,
+  /// and how long the ping may go unanswered.
+  reactor::Clock::duration db_timeout;
+  /// Identifies this daemon among those sharing the database.
+  string name;
+  /// How long a claim on a job lasts unless renewed.
+  std::chrono::seconds claim_lease;
+  /// How many claimed jobs may wait for a busy machine at most.
+  size_t claim_batch;
+  /// How long ago a job nobody claimed may have started and still be
+  /// taken.
+  std::chrono::seconds recover_within;
+};
+
 struct State {
   const postgres::ConnectionParams conn_params;
-  WaitQueue waiting;
+  const scheduler::Score score;
+  postgres::Pool db;
+  const reactor::Clock::duration db_timeout;
+  reactor::Reactor reactor;
+  nix::ref<nix::Store> local_store;
+  Sync<WaitQueue> waiting;
+  Sync<capabilities::Index> index;
+  Sync<nar_cache::NarCache> nar_cache;
+  transfer::Scheduler transfers;
+  /// Where the events heard on the single LISTEN connection go.
+  routes::Routes routes;
+  const string name;
+  const std::chrono::seconds claim_lease;
+  const size_t claim_batch;
+  const std::chrono::seconds recover_within;
+  /// Held while claiming, so that jobs are dispatched in the order claimed.
+  std::mutex claiming;
+  /// Set once a slot went idle or took a waiting job, for keep_claims to
+  /// claim again without waiting for its next renewal.
+  Sync<bool> claim_wanted;
+  condition_variable claim_wakeup;
+  Builders builders;
   Slots ready;
   Slots busy;
   Sync<optional<nix::Error>> exc_;
   condition_variable fatal;
 
-  State(postgres::ConnectionParams const &conn_params)
-      : conn_params(conn_params), waiting(), ready(), busy(), exc_(), fatal() {
+  State(postgres::ConnectionParams const &conn_params, Options const &options)
+      : conn_params(conn_params), score(options.score),
+        db(conn_params, options.max_db_connections),
+        db_timeout(options.db_timeout), reactor(),
+        local_store(nix::openStore()), waiting(), index(),
+        nar_cache(nar_cache::NarCache(options.nar_cache_bytes,
+                                      options.nar_cache_compression)),
+        transfers(local_store, nar_cache, options.max_transfers,
+                  options.max_machine_transfers),
+        routes(), name(options.name), claim_lease(options.claim_lease),
+        claim_batch(options.claim_batch),
+        recover_within(options.recover_within), claiming(),
+        claim_wanted(false), claim_wakeup(), builders(), ready(), busy(),
+        exc_(), fatal() {
 
     auto machines = nix::getMachines();
 
-    auto mk_slots = [&conn_params](nix::Machine const &m) {
+    auto mk_builder = [&options](nix::Machine const &m) {
       auto mach =
           std::make_shared<nix::Machine>(machines::sort_unique_system_types(m));
 
-      return std::make_shared<Worker>(conn_params, mach);
+      // Enough connections for every slot to build while uploads run
+      auto store_settings = machines::StoreSettings{
+          .max_connections = mach->maxJobs + options.max_machine_transfers,
+          .compress = options.compress_transfers,
+      };
+
+      return std::make_shared<Builder>(mach, store_settings,
+                                       options.valid_path_ttl);
     };
 
-    std::transform(machines.begin(), machines.end(), std::back_inserter(ready),
-                   mk_slots);
+    std::transform(machines.begin(), machines.end(),
+                   std::back_inserter(builders), mk_builder);
+
+    auto idx(index.lock());
 
-    std::sort(ready.begin(), ready.end(),
-              [](shared_ptr<Worker> const &a, shared_ptr<Worker> const &b) {
-                return machines::priority_lt(a->machine, b->machine);
-              });
+    for (size_t i = 0; i < builders.size(); i++)
+      for (unsigned int slot = 0; slot < builders[i]->machine->maxJobs;
+           slot++) {
+        auto worker = std::make_shared<Worker>(db, builders[i], slot);
+
+        worker->id = idx->add(*worker->machine, i);
+
+        ready.push_back(worker);
+      }
   }
 };
 
-void main(postgres::ConnectionParams const &conn_params);
+void main(postgres::ConnectionParams const &conn_params,
+          Options const &options);
 
 void quit(nix::ref<State> &state, nix::Error const &e);
 
 void quit(nix::ref<State> &state, dequeue::Error const &e);
 
-void listen_queue(nix::ref<State> &state, Buffer<ListenResult *> &buf);
-
-void collect_events(nix::ref<State> &state, Buffer<ListenResult *> &buf);
-
-void handle_event(nix::ref<State> &state, PGconn *conn, Event const &event);
+/// Has state->reactor deliver the events of all jobs to buf.
+void listen_queue(nix::ref<State> &state, Buffer<Notified> &buf);
+
+/// Handles the events in buf in order, fetching the payloads of those
+/// that arrived together in one query. Start events are only a hint to
+/// claim. A lost connection is replaced through catch_up.
+void collect_events(nix::ref<State> &state, Buffer<Notified> &buf);
+
+/// Listens again, and hands the workers the events of their jobs they
+/// missed meanwhile, reading only those after the last they got. Jobs
+/// started meanwhile are left to claim.
+void catch_up(nix::ref<State> &state, PGconn *conn, Buffer<Notified> &buf);
+
+/// Claims pending jobs, as many as there are idle slots plus room in the
+/// wait queue, and dispatches them. Passes on those none of the machines
+/// could ever build. Jobs taken over after being accepted are built again
+/// from the start.
+void claim(nix::ref<State> &state, PGconn *conn);
+
+/// Has keep_claims claim again as soon as it can.
+void want_claim(nix::ref<State> &state);
+
+/// Renews the claims of this daemon every third of a lease, and claims the
+/// jobs whose lease ran out, e.g. because their daemon died. Claims in
+/// between whenever want_claim asks.
+void keep_claims(nix::ref<State> &state);
+
+/// Leaves the jobs no machine could ever build in denied, so that a whole
+/// batch of them is passed on in one statement.
+void handle_event(nix::ref<State> &state, PGconn *conn, Event const &event,
+                  vector<Uuid> &denied);
 
 void handle_err(nix::ref<State> &state, PGconn *conn,
                 dequeue::Error const &err);
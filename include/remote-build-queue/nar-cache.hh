@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+using std::list;
+using std::map;
+using std::shared_ptr;
+using std::string;
+
+namespace remote_build {
+namespace queue {
+namespace nar_cache {
+
+/// NARs recently sent to some machine, keyed by NAR hash, so that sending
+/// the same path to the next machine does not dump it from the local store
+/// again. Entries are stored compressed with compression ("none" to store
+/// them as is) and the least recently used are evicted beyond max_bytes.
+struct NarCache {
+private:
+  struct Entry {
+    shared_ptr<const string> data;
+    list<string>::iterator used;
+  };
+
+  map<string, Entry> entries;
+  /// Most recently used first
+  list<string> lru;
+  size_t bytes;
+
+public:
+  const size_t max_bytes;
+  const string compression;
+
+  NarCache(size_t max_bytes, string const &compression)
+      : entries(), lru(), bytes(0), max_bytes(max_bytes),
+        compression(compression) {}
+
+  /// The stored, possibly compressed, NAR. nullptr if not cached.
+  shared_ptr<const string> lookup(string const &nar_hash);
+
+  /// Stores an already compressed NAR, evicting others to make room.
+  void insert(string const &nar_hash, shared_ptr<const string> data);
+
+  /// Whether a NAR of nar_size bytes is worth buffering for the cache.
+  bool admits(size_t nar_size) const { return nar_size <= max_bytes / 4; }
+};
+
+} // namespace nar_cache
+} // namespace queue
+} // namespace remote_build
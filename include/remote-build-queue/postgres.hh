@@ -1,7 +1,10 @@
+#include <chrono>
 #include <map>
 #include <string>
 #include <variant>
+#include <vector>
 
+#include <event.hh>
 #include <postgres.hh>
 #include <uuid.hh>
 
@@ -9,6 +12,7 @@ using std::map;
 using std::monostate;
 using std::string;
 using std::variant;
+using std::vector;
 
 using remote_build::uuid::Uuid;
 
@@ -25,10 +29,37 @@ variant<string, EnvVar> env_conn_param(string const key,
 variant<string, postgres::ConnectionParams>
 env_conn_params(map<string, string> const &env);
 
-variant<string, monostate> no_machine_available(PGconn *, Uuid const &job);
+struct Claimed {
+  event::Start start;
+  /// Whether it was accepted already, by a daemon that went away since.
+  bool resumed;
+};
+
+/// Takes up to n unfinished jobs for daemon, for lease. Those nobody
+/// claimed that started more than horizon ago are left alone.
+variant<string, vector<Claimed>> claim_jobs(PGconn *, string const &daemon,
+                                            std::chrono::seconds lease,
+                                            size_t n,
+                                            std::chrono::seconds horizon);
+
+/// Lets the claims of a previous run of daemon lapse right away.
+variant<string, monostate> release_claims(PGconn *, string const &daemon);
+
+/// Gives up the claims on jobs daemon can not build, denying them all in a
+/// single statement once no live daemon is left to try.
+variant<string, monostate> pass_jobs(PGconn *, string const &daemon,
+                                     vector<Uuid> const &jobs);
+
+variant<string, monostate> renew_claims(PGconn *, string const &daemon,
+                                        std::chrono::seconds lease);
 
 variant<string, monostate> accept_job(PGconn *, Uuid const &job,
                                       string const &store_uri);
 
+variant<string, monostate> succeed_job(PGconn *, Uuid const &job);
+
+variant<string, monostate> fail_job(PGconn *, Uuid const &job,
+                                    string const &msg);
+
 } // namespace queue
 } // namespace remote_build
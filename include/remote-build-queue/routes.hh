@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+
+#include <nix/sync.hh>
+
+#include <dequeue.hh>
+#include <event.hh>
+#include <uuid.hh>
+
+using std::map;
+using std::set;
+using std::shared_ptr;
+
+using nix::Sync;
+
+using remote_build::dequeue::Buffer;
+using remote_build::uuid::Uuid;
+
+namespace remote_build {
+namespace queue {
+namespace routes {
+
+typedef Buffer<event::Event> Mailbox;
+
+/// Hands the events the daemon hears on its single LISTEN connection to
+/// the workers building the jobs they are about.
+struct Routes {
+private:
+  struct Route {
+    shared_ptr<Mailbox> mailbox;
+    /// The seq of the last event delivered, to drop those heard twice.
+    int64_t seq;
+  };
+
+  Sync<map<Uuid, Route>> mailboxes;
+  /// Claimed jobs another daemon accepted before going away.
+  Sync<set<Uuid>> resumed;
+
+public:
+  Routes() : mailboxes(), resumed() {}
+
+  /// Starts collecting the events of job, until forget(job).
+  shared_ptr<Mailbox> subscribe(Uuid const &job);
+
+  void forget(Uuid const &job);
+
+  /// Returns whether a worker was waiting for event. Events already
+  /// delivered are dropped.
+  bool deliver(event::Event const &event);
+
+  /// The seq of the last event delivered for every subscribed job, for
+  /// catching up on those missed.
+  map<Uuid, int64_t> cursors();
+
+  /// Marks job as taken over, its events so far missed.
+  void resume(Uuid const &job);
+
+  /// Returns whether job was marked by resume, and unmarks it.
+  bool resuming(Uuid const &job);
+};
+
+} // namespace routes
+} // namespace queue
+} // namespace remote_build
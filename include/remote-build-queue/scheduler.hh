@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <nix/machines.hh>
+
+#include <job.hh>
+
+using std::map;
+using std::optional;
+using std::string;
+using std::vector;
+
+namespace remote_build {
+namespace queue {
+namespace scheduler {
+
+/// An idle slot that could take a job, along with its machine's load.
+struct Candidate {
+  size_t slot;
+  nix::Machine const *machine;
+  /// Slots of the machine not holding a job, this one among them.
+  unsigned int free_slots;
+  /// Features the machine supports that the job does not need.
+  size_t unused_features;
+  /// Moving average of the machine's recent build durations.
+  optional<double> mean_build_secs;
+  /// mean_build_secs relative to the other candidates, 1 if unknown.
+  double relative_duration;
+  /// Share of the job's input closure, by size, the machine still needs.
+  /// 0 if the closure is unknown.
+  double missing_fraction;
+};
+
+/// Ranks a candidate for a job. Higher is better.
+typedef double (*Score)(Candidate const &candidate, job::Job const &job);
+
+/// Prefers the fastest machine, regardless of load.
+double score_speed(Candidate const &candidate, job::Job const &job);
+
+/// Spreads jobs over machines in proportion to their speedFactor and the
+/// share of their slots still free, discounting machines whose recent
+/// builds ran long and keeping machines with features the job does not
+/// need free for jobs that do.
+/// Machines already holding the job's inputs get up to twice the score.
+double score_load(Candidate const &candidate, job::Job const &job);
+
+/// Like score_load, but strongly prefers the machine missing the fewest
+/// input bytes. Suits fleets where copying inputs outweighs building.
+double score_locality(Candidate const &candidate, job::Job const &job);
+
+extern map<string, Score> const policies;
+
+const string default_policy = "load";
+
+optional<Score> policy(string const &name);
+
+/// The best candidate according to score, ties going to the lowest slot.
+optional<size_t> pick(Score score, vector<Candidate> candidates,
+                      job::Job const &job);
+
+} // namespace scheduler
+} // namespace queue
+} // namespace remote_build
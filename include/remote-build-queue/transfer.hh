@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nix/store-api.hh>
+#include <nix/sync.hh>
+
+#include <remote-build-queue/nar-cache.hh>
+
+using std::condition_variable;
+using std::map;
+using std::optional;
+using std::pair;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+using nix::Sync;
+
+namespace remote_build {
+namespace queue {
+namespace transfer {
+
+typedef std::chrono::steady_clock::time_point Priority;
+
+/// Uploads inputs to machines on behalf of every worker.
+///
+/// A path on its way to a machine is sent once, however many jobs need it.
+/// At most max_streams uploads run at a time, at most max_machine_streams
+/// of them to any one machine. Among the uploads ready to go, the ones
+/// needed by the job with the earliest priority go first. A path is only
+/// ready once its references are valid on the machine.
+struct Scheduler {
+private:
+  struct Task {
+    string uri;
+    nix::Store *remote;
+    nix::StorePath path;
+    Priority priority;
+    /// Distinguishes tasks of equal priority
+    uint64_t seq;
+    /// References still on their way to the machine
+    size_t blocked_on;
+    vector<shared_ptr<Task>> dependents;
+    bool done;
+    optional<string> error;
+  };
+
+  struct ByPriority {
+    bool operator()(shared_ptr<Task> const &a,
+                    shared_ptr<Task> const &b) const {
+      return std::make_pair(a->priority, a->seq) <
+             std::make_pair(b->priority, b->seq);
+    }
+  };
+
+  struct Queue {
+    /// Tasks not finished yet, by machine uri and path
+    map<pair<string, nix::StorePath>, shared_ptr<Task>> tasks;
+    std::set<shared_ptr<Task>, ByPriority> ready;
+    /// Running uploads per machine uri
+    map<string, unsigned int> streams;
+    uint64_t seq;
+  };
+
+  nix::ref<nix::Store> local;
+  Sync<nar_cache::NarCache> &cache;
+  Sync<Queue> queue;
+  /// Signalled when a task becomes ready
+  condition_variable runnable;
+  /// Signalled when a task finishes
+  condition_variable finished;
+
+  void finish(Queue &q, shared_ptr<Task> const &task,
+              optional<string> const &error);
+
+public:
+  const unsigned int max_streams;
+  const unsigned int max_machine_streams;
+
+  Scheduler(nix::ref<nix::Store> local, Sync<nar_cache::NarCache> &cache,
+            unsigned int max_streams, unsigned int max_machine_streams)
+      : local(local), cache(cache),
+        queue(Queue{.tasks = {}, .ready = {}, .streams = {}, .seq = 0}),
+        runnable(), finished(), max_streams(max_streams),
+        max_machine_streams(max_machine_streams) {}
+
+  /// Makes paths, a closure, valid on the machine at uri. Blocks until
+  /// done and throws nix::Error if any upload fails.
+  void copy(string const &uri, nix::Store &remote,
+            nix::StorePathSet const &paths, nix::SubstituteFlag substitute,
+            Priority priority);
+
+  /// Runs uploads forever. Meant for max_streams threads.
+  void run();
+};
+
+} // namespace transfer
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+
+#include <nix/store-api.hh>
+
+using std::map;
+
+namespace remote_build {
+namespace queue {
+namespace valid_paths {
+
+typedef std::chrono::steady_clock Clock;
+
+/// Paths known to be valid on one machine, so they need not be queried
+/// again before copying. Each path is forgotten ttl after it was last
+/// seen valid. A ttl of zero disables the cache.
+struct ValidPaths {
+private:
+  Clock::duration ttl;
+  map<nix::StorePath, Clock::time_point> expiry;
+  Clock::time_point next_prune;
+
+public:
+  ValidPaths(Clock::duration ttl)
+      : ttl(ttl), expiry(), next_prune(Clock::now() + ttl) {}
+
+  void insert(nix::StorePathSet const &paths);
+
+  bool contains(nix::StorePath const &path) const;
+
+  /// The subset of paths not known to be valid.
+  nix::StorePathSet unknown(nix::StorePathSet const &paths) const;
+
+  /// Forgets everything, for instance after the machine collected garbage.
+  void clear();
+};
+
+} // namespace valid_paths
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <vector>
+
+#include <event.hh>
+#include <job.hh>
+#include <remote-build-queue/locality.hh>
+
+using std::optional;
+using std::priority_queue;
+using std::shared_ptr;
+
+namespace remote_build {
+namespace queue {
+namespace wait_queue {
+
+/// A job to build, with its input closure as read once on dispatch, for
+/// the slot building it to prefetch. Empty if it could not be read.
+struct Todo {
+  event::Start start;
+  shared_ptr<locality::Closure const> closure;
+};
+
+struct OldestFirst {
+  bool operator()(Todo const &a, Todo const &b) const {
+    return event::OldestFirst<job::Job>()(a.start, b.start);
+  }
+};
+
+/// Jobs some machine could build, but every capable machine is busy.
+/// The oldest job is on top.
+typedef priority_queue<Todo, std::vector<Todo>, OldestFirst> WaitQueue;
+
+/// Removes and returns the oldest waiting job satisfying can_build.
+optional<Todo> take(WaitQueue &waiting,
+                    std::function<bool(job::Job const &)> can_build);
+
+} // namespace wait_queue
+} // namespace queue
+} // namespace remote_build
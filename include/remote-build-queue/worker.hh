@@ -1,6 +1,8 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <optional>
 #include <queue>
 #include <utility>
@@ -17,7 +19,13 @@
 #include <event.hh>
 #include <job.hh>
 #include <postgres.hh>
+#include <remote-build-queue/capabilities.hh>
+#include <remote-build-queue/locality.hh>
 #include <remote-build-queue/machines.hh>
+#include <remote-build-queue/routes.hh>
+#include <remote-build-queue/transfer.hh>
+#include <remote-build-queue/valid-paths.hh>
+#include <remote-build-queue/wait-queue.hh>
 
 using std::condition_variable;
 using std::monostate;
@@ -36,6 +44,7 @@ using nix::Verbosity::lvlDebug;
 using nix::Verbosity::lvlError;
 
 using remote_build::dequeue::Buffer;
+using remote_build::queue::wait_queue::WaitQueue;
 
 namespace remote_build {
 namespace queue {
@@ -43,25 +52,27 @@ namespace worker {
 
 typedef Buffer<pair<nix::Machine *, nix::Error>> Wakeup;
 
-struct Worker {
+/// A build machine and the store connection shared by all of its slots.
+struct Builder {
 private:
   shared_ptr<nix::AutoCloseFD> write_ssh;
 
 public:
-  const postgres::ConnectionParams conn_params;
   shared_ptr<nix::Machine> machine;
   shared_ptr<nix::AutoCloseFD> read_ssh;
   shared_ptr<nix::Store> store;
-  shared_ptr<PGconn> conn;
-  Sync<unique_ptr<event::Start>> todo;
-  condition_variable inbox;
-
-  Worker(postgres::ConnectionParams const &conn_params,
-         shared_ptr<nix::Machine> const machine)
-      : write_ssh(), conn_params(conn_params), machine(machine), read_ssh(),
-        store(), conn(),
-        todo(Sync<unique_ptr<event::Start>>(unique_ptr<event::Start>{})),
-        inbox() {
+  /// Number of slots currently holding a job.
+  std::atomic<unsigned int> occupied;
+  /// Exponential moving average of build durations, in seconds.
+  Sync<optional<double>> mean_build_secs;
+  /// Paths copied to or built on the machine, and so valid there.
+  Sync<valid_paths::ValidPaths> valid_paths;
+
+  Builder(shared_ptr<nix::Machine> const machine,
+          machines::StoreSettings const &store_settings,
+          valid_paths::Clock::duration valid_path_ttl)
+      : write_ssh(), machine(machine), read_ssh(), store(), occupied(0),
+        mean_build_secs(), valid_paths(valid_path_ttl) {
     debug("connecting to store: %s", machine->storeUri);
 
     nix::Pipe ssh_pipe;
@@ -69,7 +80,7 @@ public:
     ssh_pipe.create();
 
     try {
-      store = machines::open_store(*machine, ssh_pipe);
+      store = machines::open_store(*machine, ssh_pipe, store_settings);
 
       read_ssh =
           std::make_shared<nix::AutoCloseFD>(std::move(ssh_pipe.readSide));
@@ -84,16 +95,64 @@ public:
 
       throw nix::Error("%s%s", e.what(), msg.empty() ? "" : ": " + msg);
     }
+  }
+
+  void record_build(double secs) {
+    auto mean(mean_build_secs.lock());
 
-    auto conn_res = postgres::connect(conn_params);
+    *mean = *mean ? 0.7 * **mean + 0.3 * secs : secs;
+  }
 
-    if (std::holds_alternative<string>(conn_res))
-      throw nix::Error(get<string>(conn_res));
+  unsigned int free_slots() const {
+    auto busy = occupied.load();
 
-    conn = get<shared_ptr<PGconn>>(conn_res);
+    return busy < machine->maxJobs ? machine->maxJobs - busy : 0;
   }
+};
+
+/// One of a Builder's machine->maxJobs concurrent build slots.
+struct Worker {
+  postgres::Pool &db;
+  shared_ptr<Builder> builder;
+  const unsigned int slot;
+  /// Position in State::ready and in the capabilities::Index
+  size_t id;
+  shared_ptr<nix::Machine> machine;
+  shared_ptr<nix::Store> store;
+  Sync<unique_ptr<wait_queue::Todo>> todo;
+  condition_variable inbox;
 
-  void run(Wakeup &wakeup);
+  Worker(postgres::Pool &db, shared_ptr<Builder> const builder,
+         unsigned int slot)
+      : db(db), builder(builder), slot(slot), id(0),
+        machine(builder->machine), store(builder->store),
+        todo(Sync<unique_ptr<wait_queue::Todo>>(
+            unique_ptr<wait_queue::Todo>{})),
+        inbox() {}
+
+  /// Hands next to this idle slot. Requires the lock on todo.
+  void assign(Sync<unique_ptr<wait_queue::Todo>>::Lock &curr,
+              wait_queue::Todo const &next);
+
+  /// Builds the job in todo, failing it if anything throws, then takes the
+  /// next job this machine can build from waiting, or marks itself idle in
+  /// index. Either way calls want_jobs, as there is room for more. Inputs
+  /// are sent through transfers and the job's events arrive through routes.
+  ///
+  /// Lock order is waiting, then index, then todo.
+  void run(Wakeup &wakeup, Sync<WaitQueue> &waiting,
+           Sync<capabilities::Index> &index, transfer::Scheduler &transfers,
+           routes::Routes &routes, std::function<void()> const &want_jobs);
+
+  /// Builds todo and records how it went, unless the job was canceled or
+  /// finished elsewhere before its inputs arrived. Returns what broke if
+  /// the database could not be used, and throws if the job itself went
+  /// wrong.
+  optional<string> build(event::Start const &todo,
+                         locality::Closure const &closure,
+                         nix::ref<nix::Store> localStore,
+                         transfer::Scheduler &transfers,
+                         routes::Routes &routes);
 
   void die(Wakeup &wakeup, nix::Error e);
 
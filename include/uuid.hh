@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <string>
 
 #include <nlohmann/json.hpp>
@@ -10,10 +11,34 @@ using std::string;
 namespace remote_build {
 namespace uuid {
 
+/// A UUID held as its 16 bytes, which is also postgres' binary format.
 struct Uuid {
-  const string val;
-  Uuid(string const &val) : val(string(val)) {}
-  Uuid(json const &j) : val(string(j.get<string>())) {}
+  std::array<unsigned char, 16> bytes;
+
+  /// Parses the 8-4-4-4-12 hex form. Throws std::invalid_argument.
+  Uuid(string const &s);
+  Uuid(json const &j) : Uuid(j.get<string>()) {}
+
+  /// Reads 16 bytes in postgres' binary format.
+  static Uuid from_bytes(char const *data);
+
+  /// A random version 4 UUID.
+  static Uuid random();
+
+  /// A version 7 UUID: milliseconds since the epoch followed by random
+  /// bits, so that later ids sort after earlier ones, like
+  /// uuid_generate_v7 in sql/job.sql.
+  static Uuid time_ordered();
+
+  /// The 8-4-4-4-12 hex form, as postgres shows it.
+  string to_string() const;
+
+  bool operator==(Uuid const &other) const { return bytes == other.bytes; }
+  bool operator!=(Uuid const &other) const { return bytes != other.bytes; }
+  bool operator<(Uuid const &other) const { return bytes < other.bytes; }
+
+private:
+  Uuid() : bytes() {}
 };
 
 } // namespace uuid
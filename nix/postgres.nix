@@ -69,6 +69,40 @@ let
         '';
       };
 
+      jobChannels = lib.mkOption {
+        type = lib.types.enum [ "subscribed" "all" ];
+        default = "subscribed";
+        description = ''
+          Which jobs have their events notified on a channel of their
+          own, besides the single channel the daemon listens on.
+
+          "subscribed" only notifies the jobs a build hook waits on.
+          "all" notifies every job, for listeners that do not
+          subscribe.
+        '';
+      };
+
+      retention = lib.mkOption {
+        type = lib.types.nullOr lib.types.str;
+        default = null;
+        example = "6 months";
+        description = ''
+          How long to keep the monthly partitions of events, job_inputs
+          and job_outputs, as a postgres interval. Older ones are
+          archived to archiveDir and dropped daily. null keeps them
+          forever.
+        '';
+      };
+
+      archiveDir = lib.mkOption {
+        type = lib.types.str;
+        default = "/var/lib/remote-build-queue/archive";
+        description = ''
+          Where partitions past their retention are archived, one
+          compressed pg_dump per partition.
+        '';
+      };
+
       authFormat = lib.mkOption {
         type = lib.types.functionTo (lib.types.functionTo lib.types.str);
         example = lib.literalExpression ''user: dbname: "local ''${dbname} ''${user} peer'';
@@ -188,6 +222,16 @@ let
       })
     ];
 
+  systemd.timers.remote-build-queue-partitions = {
+    wantedBy = [ "timers.target" ];
+
+    timerConfig = {
+      OnCalendar = "daily";
+
+      Persistent = true;
+    };
+  };
+
   services = {
     postgresql = {
       enable = true;
@@ -319,6 +363,50 @@ let
 
           rm -f ${config.users.users."${cfg.admin}".home}/.remote-build-queue-init
         fi
+
+        $PSQL -c "ALTER DATABASE ${cfg.database} SET remote_build.job_channels = '${cfg.jobChannels}'"
+      '';
+    };
+
+    remote-build-queue-partitions = {
+      description = "remote build queue partition maintenance";
+
+      wants = [ "remote-build-queue-init-db.service" ];
+
+      after = [ "remote-build-queue-init-db.service" ];
+
+      serviceConfig = {
+        User = cfg.admin;
+
+        Group = users.users."${cfg.admin}".group;
+
+        Type = "oneshot";
+      };
+
+      environment = {
+        PSQL =
+          "${postgresql.package}/bin/psql -w -U ${cfg.admin} -h ${cfg.host} -d ${cfg.database}";
+
+        PG_DUMP =
+          "${postgresql.package}/bin/pg_dump -w -U ${cfg.admin} -h ${cfg.host} -d ${cfg.database}";
+      };
+
+      script = ''
+        set -o pipefail
+
+        $PSQL -c "SELECT ${cfg.admin}.create_partitions()"
+      '' + lib.optionalString (cfg.retention != null) ''
+        mkdir -p ${cfg.archiveDir}
+
+        # A partition that fails to archive stays detached, not dropped
+        $PSQL -tA -c "SELECT * FROM ${cfg.admin}.detach_partitions('${cfg.retention}')" \
+          | while read -r partition
+            do
+              $PG_DUMP -Fc -Z 9 -t "${cfg.admin}.$partition" \
+                -f "${cfg.archiveDir}/$partition.dump"
+
+              $PSQL -c "DROP TABLE ${cfg.admin}.$partition"
+            done
       '';
     };
 
@@ -1,6 +1,9 @@
 -- User-facing api to @database@
 -- To be run as @admin@
 
+-- For databases made before jobs could succeed
+ALTER TYPE @schema@.event ADD VALUE IF NOT EXISTS 'succeed';
+
 DROP VIEW IF EXISTS @schema@.view_jobs;
 
 CREATE TYPE @schema@.job_event_ts AS (name @schema@.event, ts timestamptz);
@@ -70,6 +73,8 @@ CREATE FUNCTION @schema@.mk_job(
   IN system @schema@.systems.name%TYPE,
   -- aka @schema@.system_features.%TYPE[] but that is not allowed, it seems
   IN system_features @schema@.textword[],
+  -- Chosen by the caller so it can listen before the job exists
+  IN job_id @schema@.jobs.id%TYPE DEFAULT @schema@.uuid_generate_v7(),
 --
   OUT id @schema@.jobs.id%TYPE
 ) AS $$
@@ -90,8 +95,8 @@ WITH new_drv AS (
   RETURNING *
 )
 , new_job AS (
-  INSERT INTO @schema@.jobs (drv, system)
-  SELECT new_drv.id, new_system.id
+  INSERT INTO @schema@.jobs (id, drv, system)
+  SELECT $4, new_drv.id, new_system.id
   FROM new_drv, new_system
   RETURNING *
 )
@@ -144,6 +149,7 @@ CREATE FUNCTION @schema@.enqueue_job(
   IN drv @schema@.drvs.filename%TYPE,
   IN system @schema@.systems.name%TYPE,
   IN system_features @schema@.textword[],
+  IN job_id @schema@.jobs.id%TYPE DEFAULT @schema@.uuid_generate_v7(),
 --
   OUT job @schema@.events.job%TYPE
 ) AS $$
@@ -151,7 +157,8 @@ INSERT INTO @schema@.events (name, job)
 SELECT 'start'::@schema@.event, @schema@.mk_job(
   $1::@schema@.drv_filename,
   $2::@schema@.textword,
-  $3::@schema@.textword[]
+  $3::@schema@.textword[],
+  $4
 )
 RETURNING job;
 $$ LANGUAGE SQL VOLATILE STRICT;
@@ -176,6 +183,11 @@ WITH new_machine AS (
   ON CONFLICT (uri) DO UPDATE SET uri = @schema@.machines.uri
   RETURNING *
 )
+-- Left by a daemon that died building it, if any
+, old_machine AS (
+  DELETE FROM @schema@.job_machines
+  WHERE @schema@.job_machines.job = $1
+)
 , job_machine AS (
   INSERT INTO @schema@.job_machines (job, machine)
   SELECT $1, new_machine.id
@@ -227,10 +239,40 @@ WITH new_error AS (
   INSERT INTO @schema@.errors (msg) VALUES ($2)
   RETURNING *
 )
-INSERT INTO @schema@.job_errors (job, error)
-SELECT $1, new_error.id FROM new_error;
+, job_error AS (
+  INSERT INTO @schema@.job_errors (job, error)
+  SELECT $1, new_error.id FROM new_error
+)
+INSERT INTO @schema@.events (name, job)
+VALUES ('fail'::@schema@.event, $1);
+$$ LANGUAGE SQL VOLATILE STRICT;
+
+DROP FUNCTION IF EXISTS @schema@.succeed_job;
+
+CREATE FUNCTION @schema@.succeed_job(
+  IN job @schema@.jobs.id%TYPE
+) RETURNS VOID AS $$
+INSERT INTO @schema@.events (name, job)
+VALUES ('succeed'::@schema@.event, $1)
 $$ LANGUAGE SQL VOLATILE STRICT;
 
+-- A lower bound on the ts of everything about job, so that lookups only
+-- touch the partitions since it started
+CREATE OR REPLACE FUNCTION @schema@.job_since(
+  IN job @schema@.jobs.id%TYPE,
+--
+  OUT since timestamptz
+) AS $$
+SELECT COALESCE(
+  (SELECT @schema@.job_state.started FROM @schema@.job_state WHERE @schema@.job_state.job = $1),
+  '-infinity'
+)
+$$
+LANGUAGE SQL
+STABLE
+STRICT
+PARALLEL SAFE;
+
 CREATE OR REPLACE FUNCTION @schema@.get_machine(
   IN job @schema@.jobs.id%TYPE,
 --
@@ -261,6 +303,7 @@ WITH inputs AS (
   INNER JOIN @schema@.inputs
   ON @schema@.job_inputs.input = @schema@.inputs.id
   WHERE @schema@.job_inputs.job = $1
+  AND @schema@.job_inputs.ts >= @schema@.job_since($1)
 )
 , outputs AS (
   SELECT array_agg(@schema@.outputs.name) AS names
@@ -268,6 +311,7 @@ WITH inputs AS (
   INNER JOIN @schema@.outputs
   ON @schema@.job_outputs.output = @schema@.outputs.id
   WHERE @schema@.job_outputs.job = $1
+  AND @schema@.job_outputs.ts >= @schema@.job_since($1)
 )
 SELECT COALESCE(inputs.filenames, '{}'), outputs.names
 FROM inputs, outputs
@@ -306,6 +350,7 @@ SELECT CASE $2
   WHEN 'accept' THEN jsonb_build_object('uri', @schema@.get_machine($1))
   WHEN 'add-inputs-and-outputs' THEN row_to_json(@schema@.get_inputs_and_outputs($1))::jsonb
   WHEN 'fail' THEN jsonb_build_object('msg', @schema@.get_error($1))
+  WHEN 'succeed' THEN '{}'::jsonb
 END 
 $$
 LANGUAGE SQL
@@ -313,39 +358,486 @@ STABLE
 STRICT
 PARALLEL SAFE;
 
+DROP FUNCTION IF EXISTS @schema@.get_payloads;
+
+-- Payloads for many events at once, for consumers of the notifications
+-- below, which only identify the event. Returned by seq, as a job can
+-- have several events of the same name.
+CREATE FUNCTION @schema@.get_payloads(
+  IN seqs @schema@.events.seq%TYPE[],
+  IN jobs @schema@.events.job%TYPE[],
+  IN names text[],
+--
+  OUT seq @schema@.events.seq%TYPE,
+  OUT payload jsonb
+) RETURNS SETOF record AS $$
+SELECT
+  wanted.seq,
+  @schema@.get_payload(wanted.job, wanted.name::@schema@.event)
+FROM ROWS FROM (unnest($1, $2, $3)) AS wanted(seq, job, name)
+$$
+LANGUAGE SQL
+STABLE
+STRICT
+PARALLEL SAFE;
+
+DROP FUNCTION IF EXISTS @schema@.event_stub;
+
+-- Identifies an event in a notification. Payloads can outgrow the 8000
+-- byte limit on notifications, and are costly to build inside the
+-- inserting transaction, so they are left out.
+CREATE FUNCTION @schema@.event_stub(
+  IN seq @schema@.events.seq%TYPE,
+  IN ts @schema@.events.ts%TYPE,
+  IN name @schema@.events.name%TYPE,
+  IN job @schema@.events.job%TYPE
+) RETURNS json AS $$
+SELECT json_build_object('seq', $1, 'ts', $2, 'name', $3, 'job', $4)
+$$
+LANGUAGE SQL
+STABLE
+STRICT
+PARALLEL SAFE;
+
+-- The single stream the daemon consumes. Every statement notifies its
+-- events as json arrays of stubs, 50 at a time to stay below the limit.
 CREATE OR REPLACE FUNCTION @schema@.notify_events()
 RETURNS TRIGGER AS $$
+BEGIN
+  PERFORM pg_notify('events', batch.stubs::text)
+  FROM (
+    SELECT json_agg(@schema@.event_stub(numbered.seq, numbered.ts, numbered.name, numbered.job) ORDER BY numbered.n) AS stubs
+    FROM (
+      SELECT new_events.*, row_number() OVER (ORDER BY new_events.seq) - 1 AS n
+      FROM new_events
+    ) AS numbered
+    GROUP BY numbered.n / 50
+    ORDER BY numbered.n / 50
+  ) AS batch;
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+DROP TRIGGER IF EXISTS event_trigger ON @schema@.events;
+
+CREATE TRIGGER event_trigger
+AFTER INSERT ON @schema@.events
+REFERENCING NEW TABLE AS new_events
+FOR EACH STATEMENT EXECUTE FUNCTION @schema@.notify_events();
+
+DROP FUNCTION IF EXISTS @schema@.subscribe_job;
+
+-- Has the events of job notified on the channel named after it as well
+CREATE FUNCTION @schema@.subscribe_job(
+  IN job @schema@.jobs.id%TYPE
+) RETURNS VOID AS $$
+INSERT INTO @schema@.job_subscriptions (job) VALUES ($1)
+ON CONFLICT DO NOTHING
+$$ LANGUAGE SQL VOLATILE STRICT;
+
+-- Which jobs get their events on their own channel, from the
+-- remote_build.job_channels setting:
+-- 'subscribed' (default) those passed to subscribe_job,
+-- 'all'        every job, for listeners that do not subscribe.
+CREATE OR REPLACE FUNCTION @schema@.job_channels() RETURNS text AS $$
+SELECT COALESCE(NULLIF(current_setting('remote_build.job_channels', true), ''), 'subscribed')
+$$
+LANGUAGE SQL
+STABLE
+PARALLEL SAFE;
+
+-- Once per job and statement, without building any SQL at runtime
+CREATE OR REPLACE FUNCTION @schema@.notify_job_channels()
+RETURNS TRIGGER AS $$
 DECLARE
-  payload jsonb;
+  everyone boolean := @schema@.job_channels() = 'all';
 BEGIN
-  SELECT @schema@.get_payload(NEW.job, NEW.name) INTO payload;
-  PERFORM pg_notify('events', (row_to_json(NEW)::jsonb || jsonb_build_object('payload', payload))::text);
-  EXECUTE format('SELECT pg_notify(%L, (row_to_json($1)::jsonb || jsonb_build_object(%L, $2))::text)', NEW.job, 'payload') USING NEW, payload;
-  RETURN NEW;
+  PERFORM pg_notify(new_events.job::text, json_agg(@schema@.event_stub(new_events.seq, new_events.ts, new_events.name, new_events.job) ORDER BY new_events.seq)::text)
+  FROM new_events
+  WHERE everyone OR EXISTS (
+    SELECT 1
+    FROM @schema@.job_subscriptions
+    WHERE @schema@.job_subscriptions.job = new_events.job
+  )
+  GROUP BY new_events.job;
+  RETURN NULL;
 END;
 $$ LANGUAGE plpgsql;
 
-CREATE OR REPLACE TRIGGER event_trigger
+DROP TRIGGER IF EXISTS job_channels_trigger ON @schema@.events;
+
+CREATE TRIGGER job_channels_trigger
 AFTER INSERT ON @schema@.events
-FOR EACH ROW EXECUTE FUNCTION @schema@.notify_events();
+REFERENCING NEW TABLE AS new_events
+FOR EACH STATEMENT EXECUTE FUNCTION @schema@.notify_job_channels();
+
+-- Keeps job_state up to date in the transaction inserting the events
+CREATE OR REPLACE FUNCTION @schema@.track_job_state()
+RETURNS TRIGGER AS $$
+BEGIN
+  WITH numbered AS (
+    SELECT new_events.*, row_number() OVER (ORDER BY new_events.seq) AS n
+    FROM new_events
+  )
+  , per_job AS (
+    SELECT
+      numbered.job,
+      (array_agg(numbered.name ORDER BY numbered.n DESC))[1] AS event,
+      max(numbered.ts) AS ts,
+      min(numbered.ts) FILTER (WHERE numbered.name = 'start') AS started,
+      min(numbered.ts) FILTER (WHERE numbered.name = 'accept') AS accepted,
+      min(numbered.ts) FILTER (WHERE numbered.name = 'add-inputs-and-outputs') AS inputs_added,
+      min(numbered.ts) FILTER (WHERE numbered.name IN ('succeed', 'cancel', 'no-machine-available', 'fail')) AS finished,
+      bool_or(numbered.name = 'fail') AS failed
+    FROM numbered
+    GROUP BY numbered.job
+  )
+  INSERT INTO @schema@.job_state AS state
+    (job, event, ts, started, accepted, inputs_added, finished, machine, error)
+  SELECT
+    per_job.job,
+    per_job.event,
+    per_job.ts,
+    per_job.started,
+    per_job.accepted,
+    per_job.inputs_added,
+    per_job.finished,
+    CASE WHEN per_job.accepted IS NOT NULL THEN @schema@.get_machine(per_job.job) END,
+    CASE WHEN per_job.failed THEN @schema@.get_error(per_job.job) END
+  FROM per_job
+  ON CONFLICT (job) DO UPDATE SET
+    event = EXCLUDED.event,
+    ts = EXCLUDED.ts,
+    started = COALESCE(state.started, EXCLUDED.started),
+    accepted = COALESCE(state.accepted, EXCLUDED.accepted),
+    inputs_added = COALESCE(state.inputs_added, EXCLUDED.inputs_added),
+    finished = COALESCE(state.finished, EXCLUDED.finished),
+    machine = COALESCE(EXCLUDED.machine, state.machine),
+    error = COALESCE(EXCLUDED.error, state.error);
+
+  -- Nobody waits on the channel of a finished job. job_channels_trigger
+  -- fires first, so its last events still go out.
+  DELETE FROM @schema@.job_subscriptions
+  USING new_events
+  WHERE @schema@.job_subscriptions.job = new_events.job
+  AND new_events.name IN ('succeed', 'cancel', 'no-machine-available', 'fail');
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+DROP TRIGGER IF EXISTS job_state_trigger ON @schema@.events;
+
+CREATE TRIGGER job_state_trigger
+AFTER INSERT ON @schema@.events
+REFERENCING NEW TABLE AS new_events
+FOR EACH STATEMENT EXECUTE FUNCTION @schema@.track_job_state();
+
+-- Jobs that have not yet succeeded, failed, been canceled or denied, oldest
+-- first
+CREATE OR REPLACE FUNCTION @schema@.get_active_jobs()
+RETURNS SETOF @schema@.job_state AS $$
+SELECT *
+FROM @schema@.job_state
+WHERE @schema@.job_state.finished IS NULL
+ORDER BY @schema@.job_state.ts
+$$
+LANGUAGE SQL
+STABLE
+PARALLEL SAFE;
+
+-- Takes up to n unfinished jobs for daemon until now() + lease. Jobs
+-- claimed by others are left alone until their lease runs out, and rows
+-- another daemon is claiming are skipped, so no two daemons ever dispatch
+-- the same job. Notifications on 'events' are only a hint to call this.
+-- Jobs that started before now() - horizon are taken to be abandoned,
+-- claimed or not, and each round only reads the recent end of
+-- job_state_active_started. Returns the jobs' start events, oldest first,
+-- like get_events, and whether they were accepted before, by a daemon that
+-- since died or restarted.
+DROP FUNCTION IF EXISTS @schema@.claim_jobs;
+
+CREATE FUNCTION @schema@.claim_jobs(
+  IN daemon text,
+  IN lease interval,
+  IN n integer,
+  IN horizon interval,
+--
+  OUT seq @schema@.events.seq%TYPE,
+  OUT ts @schema@.events.ts%TYPE,
+  OUT name @schema@.events.name%TYPE,
+  OUT job @schema@.events.job%TYPE,
+  OUT payload jsonb,
+  OUT resumed boolean
+) RETURNS SETOF record AS $$
+WITH alive AS (
+  INSERT INTO @schema@.daemons (name, until) VALUES ($1, now() + $2)
+  ON CONFLICT (name) DO UPDATE SET until = EXCLUDED.until
+)
+, pending AS (
+  SELECT
+    @schema@.job_state.job,
+    @schema@.job_state.started,
+    @schema@.job_state.accepted IS NOT NULL AS resumed
+  FROM @schema@.job_state
+  LEFT JOIN @schema@.claims
+  ON @schema@.claims.job = @schema@.job_state.job
+  WHERE @schema@.job_state.finished IS NULL
+  AND @schema@.job_state.started >= now() - $4
+  AND (
+    @schema@.claims.job IS NULL
+    OR (@schema@.claims.until < now() AND NOT $1 = ANY (@schema@.claims.passed))
+  )
+  ORDER BY @schema@.job_state.started
+  LIMIT $3
+  FOR UPDATE OF job_state SKIP LOCKED
+)
+, claimed AS (
+  INSERT INTO @schema@.claims AS claim (job, daemon, until)
+  SELECT pending.job, $1, now() + $2
+  FROM pending
+  ON CONFLICT (job) DO UPDATE
+  SET daemon = EXCLUDED.daemon, until = EXCLUDED.until
+  WHERE claim.until < now()
+  RETURNING claim.job
+)
+SELECT
+  (
+    SELECT min(@schema@.events.seq)
+    FROM @schema@.events
+    WHERE @schema@.events.job = claimed.job
+    AND @schema@.events.name = 'start'
+    AND @schema@.events.ts >= pending.started
+  ),
+  pending.started,
+  'start'::@schema@.event,
+  claimed.job,
+  @schema@.get_payload(claimed.job, 'start'),
+  pending.resumed
+FROM claimed
+INNER JOIN pending
+ON pending.job = claimed.job
+ORDER BY pending.started
+$$ LANGUAGE SQL VOLATILE STRICT;
+
+-- Denies the pending jobs no live daemon is left to claim
+CREATE OR REPLACE FUNCTION @schema@.deny_passed() RETURNS VOID AS $$
+INSERT INTO @schema@.events (name, job)
+SELECT 'no-machine-available'::@schema@.event, @schema@.claims.job
+FROM @schema@.claims
+INNER JOIN @schema@.job_state
+ON @schema@.job_state.job = @schema@.claims.job
+WHERE @schema@.claims.until < now()
+AND cardinality(@schema@.claims.passed) > 0
+AND @schema@.job_state.finished IS NULL
+AND @schema@.job_state.accepted IS NULL
+AND NOT EXISTS (
+  SELECT 1
+  FROM @schema@.daemons
+  WHERE @schema@.daemons.until >= now()
+  AND NOT @schema@.daemons.name = ANY (@schema@.claims.passed)
+)
+$$ LANGUAGE SQL VOLATILE STRICT;
 
-CREATE OR REPLACE FUNCTION @schema@.get_events(
+-- Gives up the claims of daemon on jobs it can not build. Jobs that every
+-- live daemon has passed on are denied.
+CREATE OR REPLACE FUNCTION @schema@.pass_jobs(
+  IN daemon text,
+  IN jobs @schema@.jobs.id%TYPE[]
+) RETURNS VOID AS $$
+UPDATE @schema@.claims
+SET until = '-infinity', passed = array_append(@schema@.claims.passed, $1)
+WHERE @schema@.claims.job = ANY ($2)
+AND @schema@.claims.daemon = $1;
+
+SELECT @schema@.deny_passed();
+$$ LANGUAGE SQL VOLATILE STRICT;
+
+-- Keeps daemon alive and extends the leases on the jobs it still holds,
+-- forgetting those that finished since
+CREATE OR REPLACE FUNCTION @schema@.renew_claims(
+  IN daemon text,
+  IN lease interval
+) RETURNS VOID AS $$
+INSERT INTO @schema@.daemons (name, until) VALUES ($1, now() + $2)
+ON CONFLICT (name) DO UPDATE SET until = EXCLUDED.until;
+
+DELETE FROM @schema@.claims
+USING @schema@.job_state
+WHERE @schema@.claims.daemon = $1
+AND @schema@.job_state.job = @schema@.claims.job
+AND @schema@.job_state.finished IS NOT NULL;
+
+UPDATE @schema@.claims
+SET until = now() + $2
+WHERE @schema@.claims.daemon = $1
+AND @schema@.claims.until >= now();
+
+SELECT @schema@.deny_passed();
+$$ LANGUAGE SQL VOLATILE STRICT;
+
+-- For a daemon starting up: lets the claims of its previous run lapse, so
+-- that it claims those jobs again right away
+CREATE OR REPLACE FUNCTION @schema@.release_claims(
+  IN daemon text
+) RETURNS VOID AS $$
+UPDATE @schema@.claims
+SET until = '-infinity'
+WHERE @schema@.claims.daemon = $1
+AND @schema@.claims.until >= now()
+$$ LANGUAGE SQL VOLATILE STRICT;
+
+DROP FUNCTION IF EXISTS @schema@.get_events;
+
+-- The events of job after the one numbered after, in order. 0 gets all
+-- of them.
+CREATE FUNCTION @schema@.get_events(
   IN id @schema@.events.job%TYPE,
+  IN after @schema@.events.seq%TYPE DEFAULT 0,
 --
+  OUT seq @schema@.events.seq%TYPE,
   OUT ts @schema@.events.ts%TYPE,
   OUT name @schema@.events.name%TYPE,
   OUT job @schema@.events.job%TYPE,
   OUT payload jsonb
-) AS $$
+) RETURNS SETOF record AS $$
 SELECT
+  @schema@.events.seq,
   @schema@.events.ts,
   @schema@.events.name,
   @schema@.events.job,
   @schema@.get_payload(@schema@.events.job, @schema@.events.name)
 FROM @schema@.events
 WHERE @schema@.events.job = $1
+AND @schema@.events.seq > $2
+AND @schema@.events.ts >= @schema@.job_since($1)
+ORDER BY @schema@.events.seq
 $$
 LANGUAGE SQL
 STABLE
 STRICT
 PARALLEL SAFE;
+
+-- get_events for many jobs at once, each after its own seq, for listeners
+-- catching up after losing their connection
+CREATE OR REPLACE FUNCTION @schema@.get_missed_events(
+  IN jobs @schema@.events.job%TYPE[],
+  IN afters @schema@.events.seq%TYPE[],
+--
+  OUT seq @schema@.events.seq%TYPE,
+  OUT ts @schema@.events.ts%TYPE,
+  OUT name @schema@.events.name%TYPE,
+  OUT job @schema@.events.job%TYPE,
+  OUT payload jsonb
+) RETURNS SETOF record AS $$
+SELECT missed.*
+FROM ROWS FROM (unnest($1, $2)) AS cursors(job, after)
+CROSS JOIN LATERAL @schema@.get_events(cursors.job, cursors.after) AS missed
+ORDER BY missed.seq
+$$
+LANGUAGE SQL
+STABLE
+STRICT
+PARALLEL SAFE;
+
+-- The tables split into monthly partitions, see job.sql
+CREATE OR REPLACE FUNCTION @schema@.partitioned_tables() RETURNS text[] AS $$
+SELECT ARRAY['events', 'job_inputs', 'job_outputs']
+$$
+LANGUAGE SQL
+IMMUTABLE
+PARALLEL SAFE;
+
+-- Makes sure there is a partition for every month from the current one
+-- until now() + ahead. Months already covered, like those of migrated
+-- tables, are skipped. To be run well before the last one fills up,
+-- otherwise rows land in the default partition.
+CREATE OR REPLACE FUNCTION @schema@.create_partitions(
+  IN ahead interval DEFAULT '2 months'
+) RETURNS VOID AS $$
+DECLARE
+  parent text;
+  month timestamptz;
+BEGIN
+  FOREACH parent IN ARRAY @schema@.partitioned_tables() LOOP
+    month := date_trunc('month', now());
+
+    WHILE month <= now() + ahead LOOP
+      BEGIN
+        EXECUTE format(
+          'CREATE TABLE IF NOT EXISTS @schema@.%I PARTITION OF @schema@.%I FOR VALUES FROM (%L) TO (%L)',
+          parent || '_' || to_char(month, 'YYYYMM'),
+          parent,
+          month,
+          month + interval '1 month'
+        );
+      EXCEPTION WHEN invalid_object_definition THEN
+        -- Overlaps a partition attached some other way
+      END;
+
+      month := month + interval '1 month';
+    END LOOP;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+SELECT @schema@.create_partitions();
+
+DROP FUNCTION IF EXISTS @schema@.detach_partitions;
+
+-- Detaches the partitions that ended more than keep ago, and returns them
+-- so they can be archived and dropped. A partition is kept as long as a
+-- job that started before it ended is still active. Jobs that started
+-- more than horizon ago are taken to be abandoned, like claim_jobs does,
+-- so that one that never finishes does not hold on to every month after.
+-- Their subscriptions are dropped as well.
+CREATE FUNCTION @schema@.detach_partitions(
+  IN keep interval,
+  IN horizon interval DEFAULT '24 hours',
+--
+  OUT detached text
+) RETURNS SETOF text AS $$
+DECLARE
+  part record;
+BEGIN
+  -- Left behind by jobs that finished before track_job_state cleaned up
+  -- after them, or were abandoned along with their hook
+  DELETE FROM @schema@.job_subscriptions
+  USING @schema@.job_state
+  WHERE @schema@.job_state.job = @schema@.job_subscriptions.job
+  AND (
+    @schema@.job_state.finished IS NOT NULL
+    OR @schema@.job_state.started < now() - horizon
+  );
+
+  FOR part IN
+    SELECT
+      child.relname AS name,
+      parent.relname AS parent,
+      (regexp_match(pg_get_expr(child.relpartbound, child.oid), 'TO \(''([^'']*)''\)'))[1]::timestamptz AS until
+    FROM pg_inherits
+    INNER JOIN pg_class child ON child.oid = pg_inherits.inhrelid
+    INNER JOIN pg_class parent ON parent.oid = pg_inherits.inhparent
+    INNER JOIN pg_namespace ON pg_namespace.oid = parent.relnamespace
+    WHERE pg_namespace.nspname = '@schema@'
+    AND parent.relname = ANY (@schema@.partitioned_tables())
+    ORDER BY until
+  LOOP
+    -- The default partition has no upper bound
+    CONTINUE WHEN part.until IS NULL OR part.until > now() - keep;
+
+    CONTINUE WHEN EXISTS (
+      SELECT 1
+      FROM @schema@.job_state
+      WHERE @schema@.job_state.finished IS NULL
+      AND @schema@.job_state.started < part.until
+      AND @schema@.job_state.started >= now() - horizon
+    );
+
+    EXECUTE format('ALTER TABLE @schema@.%I DETACH PARTITION @schema@.%I', part.parent, part.name);
+
+    detached := part.name;
+
+    RETURN NEXT;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
@@ -12,47 +12,71 @@ CREATE DOMAIN @schema@.output_path AS @schema@.base32 CHECK (VALUE !~ '\.drv$');
 
 CREATE DOMAIN @schema@.textword AS text CHECK (VALUE <> '' AND VALUE !~ '[ \n\t\r]');
 
+-- A version 7 uuid, which starts with the time it was made in milliseconds.
+-- Unlike random ones, new keys land at the end of their btree indexes.
+-- https://www.rfc-editor.org/rfc/rfc9562#name-uuid-version-7
+CREATE OR REPLACE FUNCTION @schema@.uuid_generate_v7() RETURNS uuid AS $$
+SELECT encode(
+  set_bit(
+    set_bit(
+      overlay(
+        uuid_send(@schema@.uuid_generate_v4())
+        PLACING substring(int8send((extract(epoch FROM clock_timestamp()) * 1000)::bigint) FROM 3)
+        FROM 1 FOR 6
+      ),
+      52, 1
+    ),
+    53, 1
+  ),
+  'hex'
+)::uuid
+$$
+LANGUAGE SQL
+VOLATILE
+PARALLEL SAFE;
+
 CREATE TYPE @schema@.event AS ENUM (
   'start',
   'cancel',
   'no-machine-available',
   'accept',
   'add-inputs-and-outputs',
-  'fail'
+  'fail',
+  'succeed'
 );
 
 CREATE TABLE IF NOT EXISTS @schema@.drvs(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   filename @schema@.drv_filename NOT NULL,
   UNIQUE (filename)
 );
 
 CREATE TABLE IF NOT EXISTS @schema@.inputs(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   filename @schema@.output_path NOT NULL,
   UNIQUE(filename)
 );
 
 CREATE TABLE IF NOT EXISTS @schema@.outputs(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   name @schema@.textword NOT NULL,
   UNIQUE(name)
 );
 
 CREATE TABLE IF NOT EXISTS @schema@.systems(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   name @schema@.textword NOT NULL,
   UNIQUE (name) 
 );
 
 CREATE TABLE IF NOT EXISTS @schema@.system_features(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   name @schema@.textword NOT NULL,
   UNIQUE (name)
 );
 
 CREATE TABLE IF NOT EXISTS @schema@.jobs(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   drv uuid NOT NULL REFERENCES @schema@.drvs(id),
   system uuid NOT NULL REFERENCES @schema@.systems(id)
 );
@@ -80,7 +104,7 @@ CREATE INDEX job_system_features_job ON @schema@.job_system_features (job);
 CREATE INDEX job_system_features_job ON @schema@.job_system_features (feature);
 
 CREATE TABLE IF NOT EXISTS @schema@.machines(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   uri @schema@.textword NOT NULL,
   UNIQUE(uri)
 );
@@ -94,36 +118,57 @@ CREATE INDEX job_machines_job ON @schema@.job_machines (job);
 
 CREATE INDEX job_machines_machine ON @schema@.job_machines (machine);
 
+-- Orders events, unlike ts, which is the same for all the events of a
+-- transaction. Listeners resume from the last one they saw.
+CREATE SEQUENCE IF NOT EXISTS @schema@.events_seq AS bigint;
+
+-- events, job_inputs and job_outputs grow forever, so they are split into
+-- monthly partitions by create_partitions in api.sql. Old ones are
+-- detached and archived by detach_partitions.
 CREATE TABLE IF NOT EXISTS @schema@.events(
+  seq bigint NOT NULL DEFAULT nextval('@schema@.events_seq'),
   ts timestamptz NOT NULL DEFAULT now(),
   name @schema@.event NOT NULL,
   job uuid NOT NULL REFERENCES @schema@.jobs(id)
-);
+) PARTITION BY RANGE (ts);
+
+ALTER SEQUENCE @schema@.events_seq OWNED BY @schema@.events.seq;
+
+CREATE TABLE IF NOT EXISTS @schema@.events_default
+PARTITION OF @schema@.events DEFAULT;
 
 CREATE INDEX events_ts ON @schema@.events (ts);
 
-CREATE INDEX events_job ON @schema@.events (job);
+CREATE INDEX events_job ON @schema@.events (job, seq);
 
 CREATE TABLE IF NOT EXISTS @schema@.job_inputs(
+  ts timestamptz NOT NULL DEFAULT now(),
   job uuid NOT NULL REFERENCES @schema@.jobs(id),
   input uuid NOT NULL REFERENCES @schema@.inputs(id)
-);
+) PARTITION BY RANGE (ts);
+
+CREATE TABLE IF NOT EXISTS @schema@.job_inputs_default
+PARTITION OF @schema@.job_inputs DEFAULT;
 
 CREATE INDEX job_inputs_job ON @schema@.job_inputs (job);
 
 CREATE INDEX job_inputs_input ON @schema@.job_inputs (input);
 
 CREATE TABLE IF NOT EXISTS @schema@.job_outputs(
+  ts timestamptz NOT NULL DEFAULT now(),
   job uuid NOT NULL REFERENCES @schema@.jobs(id),
   output uuid NOT NULL REFERENCES @schema@.outputs(id)
-);
+) PARTITION BY RANGE (ts);
+
+CREATE TABLE IF NOT EXISTS @schema@.job_outputs_default
+PARTITION OF @schema@.job_outputs DEFAULT;
 
 CREATE INDEX job_outputs_job ON @schema@.job_outputs (job);
 
 CREATE INDEX job_outputs_output ON @schema@.job_outputs (output);
 
 CREATE TABLE IF NOT EXISTS @schema@.errors(
-  id uuid DEFAULT @schema@.uuid_generate_v4() PRIMARY KEY,
+  id uuid DEFAULT @schema@.uuid_generate_v7() PRIMARY KEY,
   msg text NOT NULL
 );
 
@@ -136,9 +181,60 @@ CREATE INDEX job_errors_job ON @schema@.job_errors(job);
 
 CREATE INDEX job_errors_error ON @schema@.job_errors(error);
 
+-- Where each job is at, kept by track_job_state as events are inserted so
+-- that it need not be replayed from events
+CREATE TABLE IF NOT EXISTS @schema@.job_state(
+  job uuid PRIMARY KEY REFERENCES @schema@.jobs(id),
+  event @schema@.event NOT NULL,
+  ts timestamptz NOT NULL,
+  started timestamptz,
+  accepted timestamptz,
+  inputs_added timestamptz,
+  -- When it succeeded, was canceled, failed or found no machine
+  finished timestamptz,
+  machine @schema@.textword,
+  error text
+);
+
+CREATE INDEX job_state_active ON @schema@.job_state (event, ts)
+WHERE finished IS NULL;
+
+CREATE INDEX job_state_active_machine ON @schema@.job_state (machine)
+WHERE finished IS NULL;
+
+CREATE INDEX job_state_active_started ON @schema@.job_state (started)
+WHERE finished IS NULL;
+
+-- Queue daemons sharing @database@, and until when they are assumed alive
+CREATE TABLE IF NOT EXISTS @schema@.daemons(
+  name text PRIMARY KEY,
+  until timestamptz NOT NULL
+);
+
+-- Which daemon dispatches and builds a job, until when, see claim_jobs.
+-- passed are the daemons that had it but could not build it.
+CREATE TABLE IF NOT EXISTS @schema@.claims(
+  job uuid PRIMARY KEY REFERENCES @schema@.jobs(id),
+  daemon text NOT NULL,
+  until timestamptz NOT NULL,
+  passed text[] NOT NULL DEFAULT '{}'
+);
+
+CREATE INDEX claims_daemon ON @schema@.claims (daemon);
+
+-- Jobs whose own channel someone listens on, see notify_job_channels
+CREATE TABLE IF NOT EXISTS @schema@.job_subscriptions(
+  job uuid PRIMARY KEY REFERENCES @schema@.jobs(id)
+);
+
 GRANT SELECT ON ALL TABLES IN SCHEMA @schema@ TO @builder@;
 
 GRANT INSERT ON ALL TABLES IN SCHEMA @schema@ TO @builder@;
 
 GRANT UPDATE ON ALL TABLES IN SCHEMA @schema@ TO @builder@;
 
+-- For renew_claims, accept_job and track_job_state
+GRANT DELETE ON @schema@.claims, @schema@.job_machines, @schema@.job_subscriptions TO @builder@;
+
+GRANT USAGE ON SEQUENCE @schema@.events_seq TO @builder@;
+
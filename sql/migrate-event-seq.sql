@@ -0,0 +1,44 @@
+-- Numbers the events of a @database@ made before events had a seq
+-- To be executed by @admin@ user while the daemon is stopped, then run
+-- api.sql again for the stubs and get_events that carry it. Either before
+-- or after migrate-partitions.sql, which leaves nothing to do here.
+--
+-- Existing events are numbered in ts order, ties in no particular order,
+-- as their transactions did not record any. New events count on from the
+-- last of them.
+
+BEGIN;
+
+CREATE SEQUENCE IF NOT EXISTS @schema@.events_seq AS bigint;
+
+ALTER TABLE @schema@.events ADD COLUMN IF NOT EXISTS seq bigint;
+
+UPDATE @schema@.events
+SET seq = numbered.seq
+FROM (
+  SELECT
+    @schema@.events.tableoid,
+    @schema@.events.ctid,
+    row_number() OVER (ORDER BY @schema@.events.ts) AS seq
+  FROM @schema@.events
+  WHERE @schema@.events.seq IS NULL
+) AS numbered
+WHERE @schema@.events.tableoid = numbered.tableoid
+AND @schema@.events.ctid = numbered.ctid;
+
+SELECT setval('@schema@.events_seq', COALESCE(max(@schema@.events.seq), 0) + 1, false)
+FROM @schema@.events;
+
+ALTER TABLE @schema@.events ALTER COLUMN seq SET DEFAULT nextval('@schema@.events_seq');
+
+ALTER TABLE @schema@.events ALTER COLUMN seq SET NOT NULL;
+
+ALTER SEQUENCE @schema@.events_seq OWNED BY @schema@.events.seq;
+
+DROP INDEX IF EXISTS @schema@.events_job;
+
+CREATE INDEX events_job ON @schema@.events (job, seq);
+
+GRANT USAGE ON SEQUENCE @schema@.events_seq TO @builder@;
+
+COMMIT;
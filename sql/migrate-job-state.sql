@@ -0,0 +1,50 @@
+-- Fills in job_state for a @database@ made before it existed
+-- To be executed by @admin@ user while the daemon is stopped, after
+-- job.sql, migrate-event-seq.sql and api.sql
+--
+-- Replays the whole of events once. Jobs already tracked by
+-- track_job_state are left alone.
+--
+-- Before jobs could succeed, a build that was done left no event, and
+-- fail_job left only job_errors rows. So a job that got as far as being
+-- accepted, or has errors, is taken to have finished with its last event.
+-- Only stop the daemon once it built what it accepted.
+
+INSERT INTO @schema@.job_state
+  (job, event, ts, started, accepted, inputs_added, finished, machine, error)
+SELECT
+  latest.job,
+  latest.name,
+  latest.ts,
+  phases.started,
+  phases.accepted,
+  phases.inputs_added,
+  COALESCE(
+    phases.finished,
+    CASE WHEN phases.accepted IS NOT NULL OR phases.inputs_added IS NOT NULL OR failed.job IS NOT NULL THEN phases.last END
+  ),
+  CASE WHEN phases.accepted IS NOT NULL THEN @schema@.get_machine(latest.job) END,
+  CASE WHEN failed.job IS NOT NULL THEN @schema@.get_error(latest.job) END
+FROM (
+  SELECT DISTINCT ON (@schema@.events.job) @schema@.events.*
+  FROM @schema@.events
+  ORDER BY @schema@.events.job, @schema@.events.seq DESC
+) AS latest
+INNER JOIN (
+  SELECT
+    @schema@.events.job,
+    min(@schema@.events.ts) FILTER (WHERE @schema@.events.name = 'start') AS started,
+    min(@schema@.events.ts) FILTER (WHERE @schema@.events.name = 'accept') AS accepted,
+    min(@schema@.events.ts) FILTER (WHERE @schema@.events.name = 'add-inputs-and-outputs') AS inputs_added,
+    min(@schema@.events.ts) FILTER (WHERE @schema@.events.name IN ('succeed', 'cancel', 'no-machine-available', 'fail')) AS finished,
+    max(@schema@.events.ts) AS last
+  FROM @schema@.events
+  GROUP BY @schema@.events.job
+) AS phases
+ON phases.job = latest.job
+LEFT JOIN (
+  SELECT DISTINCT @schema@.job_errors.job
+  FROM @schema@.job_errors
+) AS failed
+ON failed.job = latest.job
+ON CONFLICT (job) DO NOTHING;
@@ -0,0 +1,151 @@
+-- Moves a @database@ made before events, job_inputs and job_outputs were
+-- partitioned over to partitioned tables
+-- To be executed by @admin@ user while the daemon is stopped, then run
+-- api.sql again to recreate the triggers on the new events table.
+-- Either before or after migrate-event-seq.sql, events left without a seq
+-- are numbered here the same way.
+--
+-- The old tables are attached as they are, as the partition of everything
+-- until the end of the current month, after which create_partitions takes
+-- over. detach_partitions archives them as a whole once that is old enough.
+-- Rows of job_inputs and job_outputs had no time. They are put at the
+-- last add-inputs-and-outputs event of their job, so that
+-- get_inputs_and_outputs still finds them for jobs in flight, and at the
+-- epoch if there is none.
+
+BEGIN;
+
+DROP TRIGGER IF EXISTS event_trigger ON @schema@.events;
+
+DROP TRIGGER IF EXISTS job_channels_trigger ON @schema@.events;
+
+DROP TRIGGER IF EXISTS job_state_trigger ON @schema@.events;
+
+ALTER TABLE @schema@.events RENAME TO events_legacy;
+
+ALTER INDEX @schema@.events_ts RENAME TO events_legacy_ts;
+
+ALTER INDEX @schema@.events_job RENAME TO events_legacy_job;
+
+CREATE SEQUENCE IF NOT EXISTS @schema@.events_seq AS bigint;
+
+ALTER TABLE @schema@.events_legacy ADD COLUMN IF NOT EXISTS seq bigint;
+
+UPDATE @schema@.events_legacy
+SET seq = numbered.seq
+FROM (
+  SELECT
+    @schema@.events_legacy.ctid,
+    row_number() OVER (ORDER BY @schema@.events_legacy.ts) AS seq
+  FROM @schema@.events_legacy
+  WHERE @schema@.events_legacy.seq IS NULL
+) AS numbered
+WHERE @schema@.events_legacy.ctid = numbered.ctid;
+
+SELECT setval('@schema@.events_seq', COALESCE(max(@schema@.events_legacy.seq), 0) + 1, false)
+FROM @schema@.events_legacy;
+
+ALTER TABLE @schema@.events_legacy ALTER COLUMN seq SET NOT NULL;
+
+ALTER TABLE @schema@.job_inputs RENAME TO job_inputs_legacy;
+
+ALTER INDEX @schema@.job_inputs_job RENAME TO job_inputs_legacy_job;
+
+ALTER INDEX @schema@.job_inputs_input RENAME TO job_inputs_legacy_input;
+
+ALTER TABLE @schema@.job_inputs_legacy
+ADD COLUMN ts timestamptz NOT NULL DEFAULT 'epoch';
+
+ALTER TABLE @schema@.job_outputs RENAME TO job_outputs_legacy;
+
+ALTER INDEX @schema@.job_outputs_job RENAME TO job_outputs_legacy_job;
+
+ALTER INDEX @schema@.job_outputs_output RENAME TO job_outputs_legacy_output;
+
+ALTER TABLE @schema@.job_outputs_legacy
+ADD COLUMN ts timestamptz NOT NULL DEFAULT 'epoch';
+
+CREATE TEMPORARY TABLE inputs_added ON COMMIT DROP AS
+SELECT @schema@.events_legacy.job, max(@schema@.events_legacy.ts) AS ts
+FROM @schema@.events_legacy
+WHERE @schema@.events_legacy.name = 'add-inputs-and-outputs'
+GROUP BY @schema@.events_legacy.job;
+
+UPDATE @schema@.job_inputs_legacy
+SET ts = inputs_added.ts
+FROM inputs_added
+WHERE inputs_added.job = @schema@.job_inputs_legacy.job;
+
+UPDATE @schema@.job_outputs_legacy
+SET ts = inputs_added.ts
+FROM inputs_added
+WHERE inputs_added.job = @schema@.job_outputs_legacy.job;
+
+CREATE TABLE @schema@.events(
+  seq bigint NOT NULL DEFAULT nextval('@schema@.events_seq'),
+  ts timestamptz NOT NULL DEFAULT now(),
+  name @schema@.event NOT NULL,
+  job uuid NOT NULL REFERENCES @schema@.jobs(id)
+) PARTITION BY RANGE (ts);
+
+-- Or it would go with the legacy table once that is archived
+ALTER SEQUENCE @schema@.events_seq OWNED BY @schema@.events.seq;
+
+CREATE TABLE @schema@.events_default
+PARTITION OF @schema@.events DEFAULT;
+
+CREATE INDEX events_ts ON @schema@.events (ts);
+
+CREATE INDEX events_job ON @schema@.events (job, seq);
+
+CREATE TABLE @schema@.job_inputs(
+  ts timestamptz NOT NULL DEFAULT now(),
+  job uuid NOT NULL REFERENCES @schema@.jobs(id),
+  input uuid NOT NULL REFERENCES @schema@.inputs(id)
+) PARTITION BY RANGE (ts);
+
+CREATE TABLE @schema@.job_inputs_default
+PARTITION OF @schema@.job_inputs DEFAULT;
+
+CREATE INDEX job_inputs_job ON @schema@.job_inputs (job);
+
+CREATE INDEX job_inputs_input ON @schema@.job_inputs (input);
+
+CREATE TABLE @schema@.job_outputs(
+  ts timestamptz NOT NULL DEFAULT now(),
+  job uuid NOT NULL REFERENCES @schema@.jobs(id),
+  output uuid NOT NULL REFERENCES @schema@.outputs(id)
+) PARTITION BY RANGE (ts);
+
+CREATE TABLE @schema@.job_outputs_default
+PARTITION OF @schema@.job_outputs DEFAULT;
+
+CREATE INDEX job_outputs_job ON @schema@.job_outputs (job);
+
+CREATE INDEX job_outputs_output ON @schema@.job_outputs (output);
+
+DO $$
+DECLARE
+  cutoff timestamptz := date_trunc('month', now()) + interval '1 month';
+  parent text;
+BEGIN
+  FOREACH parent IN ARRAY ARRAY['events', 'job_inputs', 'job_outputs'] LOOP
+    -- Lets ATTACH skip scanning the whole table
+    EXECUTE format(
+      'ALTER TABLE @schema@.%I ADD CONSTRAINT %I CHECK (ts < %L)',
+      parent || '_legacy', parent || '_legacy_bound', cutoff
+    );
+
+    EXECUTE format(
+      'ALTER TABLE @schema@.%I ATTACH PARTITION @schema@.%I FOR VALUES FROM (MINVALUE) TO (%L)',
+      parent, parent || '_legacy', cutoff
+    );
+  END LOOP;
+END;
+$$;
+
+GRANT SELECT, INSERT, UPDATE ON @schema@.events, @schema@.job_inputs, @schema@.job_outputs TO @builder@;
+
+GRANT USAGE ON SEQUENCE @schema@.events_seq TO @builder@;
+
+COMMIT;
@@ -0,0 +1,43 @@
+-- Moves a @database@ made before uuid_generate_v7 over to time-ordered keys
+-- To be executed by @admin@ user, after job.sql and api.sql
+--
+-- Existing rows keep their random keys, they are still valid uuids and
+-- everything referencing them stays as is. New rows get version 7 keys,
+-- which start with the time and so are clustered together at one point
+-- of each index, among the random keys rather than after them. Inserts
+-- then only touch the pages at that point. Rebuilding the indexes
+-- afterwards packs the pages left half empty by random inserts. REINDEX
+-- CONCURRENTLY can not run in a transaction, so run this with plain
+-- psql -f.
+
+ALTER TABLE @schema@.drvs ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.inputs ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.outputs ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.systems ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.system_features ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.jobs ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.machines ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+ALTER TABLE @schema@.errors ALTER COLUMN id SET DEFAULT @schema@.uuid_generate_v7();
+
+REINDEX TABLE CONCURRENTLY @schema@.jobs;
+
+REINDEX TABLE CONCURRENTLY @schema@.events;
+
+REINDEX TABLE CONCURRENTLY @schema@.job_system_features;
+
+REINDEX TABLE CONCURRENTLY @schema@.job_machines;
+
+REINDEX TABLE CONCURRENTLY @schema@.job_inputs;
+
+REINDEX TABLE CONCURRENTLY @schema@.job_outputs;
+
+REINDEX TABLE CONCURRENTLY @schema@.job_errors;
+
+REINDEX TABLE CONCURRENTLY @schema@.errors;
@@ -3,6 +3,7 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 
 #include <nix/local-fs-store.hh>
@@ -28,6 +29,9 @@ using nlohmann::json;
 namespace remote_build {
 namespace enqueue {
 
+/// How long to wait for an event before checking the server still answers.
+static constexpr auto quiet_timeout = std::chrono::seconds(60);
+
 /// Implements the hook side of the hook/build "protocol".
 ///
 /// The other side of this protocol is another process sending
@@ -61,7 +65,7 @@ MainResult main(ConnectionParams const &conn_params) {
 
   auto ctx = std::make_shared<Ctx>(input, settings, conn_);
 
-  auto enqueue_res = postgres::enqueue_job(ctx->conn.get(), *reqs);
+  auto enqueue_res = postgres::enqueue_and_listen(ctx->conn.get(), *reqs);
 
   debug(concat_strings::sep(
       vector<string>{remote_build::postgres::show_conn_string(ctx->conn.get()),
@@ -75,26 +79,17 @@ MainResult main(ConnectionParams const &conn_params) {
   if (std::holds_alternative<string>(enqueue_res))
     return MainResult{get<string>(enqueue_res)};
 
-  auto job_id = get<Uuid>(enqueue_res);
+  auto enqueued = get<postgres::Enqueued>(enqueue_res);
+
+  auto job_id = enqueued.job;
 
   auto interrupt_cb = nix::createInterruptCallback(
       [&ctx, &job_id]() { postgres::cancel_job(ctx->conn.get(), job_id); });
 
-  auto events_res = dequeue::listen_channel(conn_params, job_id.val);
-
-  if (std::holds_alternative<string>(events_res))
-    return MainResult{get<string>(events_res)};
-
-  auto events = get<dequeue::Events>(events_res);
-
-  auto seed_events_res = dequeue::get_events(ctx->conn.get(), job_id);
-
-  if (std::holds_alternative<string>(seed_events_res))
-    return MainResult{get<string>(seed_events_res)};
-
-  auto seed_events = get<std::queue<ListenResult>>(seed_events_res);
+  auto events = dequeue::Events(shared_ptr<PGconn>(ctx->conn), job_id,
+                                quiet_timeout);
 
-  auto events_iter = events.begin(std::move(seed_events));
+  auto events_iter = events.begin(std::move(enqueued.seed));
 
   shared_ptr<event::Accept> accepted;
 
@@ -4,53 +4,82 @@ namespace remote_build {
 namespace enqueue {
 namespace postgres {
 
-variant<string, Uuid> enqueue_job(PGconn *conn, BuildRequirements const &reqs) {
-  auto drv_path = string(reqs.drv_path.to_string());
+static remote_build::postgres::Prepared const select_cancel_job{
+    .name = "cancel_job",
+    .stmt = "SELECT @schema@.cancel_job($1)",
+};
 
-  auto needed_system = string(reqs.needed_system.data());
+static remote_build::postgres::Prepared const select_add_inputs_and_outputs{
+    .name = "add_inputs_and_outputs",
+    .stmt = "SELECT @schema@.add_inputs_and_outputs("
+            "$1, $2::@schema@.output_path[], $3::@schema@.textword[])",
+};
 
-  auto required_features =
-      remote_build::postgres::to_sql_array(reqs.required_features);
+variant<string, Enqueued> enqueue_and_listen(PGconn *conn,
+                                             BuildRequirements const &reqs) {
+  // Picking the id here lets us listen on it in the same round trip
+  auto job = Uuid::time_ordered();
 
-  char *params[3] = {drv_path.data(), needed_system.data(),
-                     required_features.data()};
+  auto channel_res =
+      remote_build::postgres::escape_identifier(conn, job.to_string());
 
-  auto enqueue_res = remote_build::postgres::exec_params(
-      conn,
-      "SELECT @schema@.enqueue_job($1::@schema@.drv_filename, "
-      "$2::@schema@.textword, $3::@schema@.textword[])",
-      3, params);
-
-  if (PQresultStatus(enqueue_res.get()) != PGRES_TUPLES_OK)
-    return variant<string, Uuid>(
-        remote_build::postgres::err_msg(enqueue_res.get(), "enqueueing job"));
-
-  int n_results;
-
-  int n_fields;
+  if (std::holds_alternative<string>(channel_res))
+    return variant<string, Enqueued>(std::get<string>(channel_res));
 
-  if ((n_results = PQntuples(enqueue_res.get())) != 1 &&
-      (n_fields = PQnfields(enqueue_res.get())) != 1)
-    return variant<string, Uuid>(
-        nix::fmt("enqueuing returned unexpected number of results: %d rows, %d "
-                 "fields (expected 1 row and 1 field)",
-                 n_results, n_fields));
+  auto channel = std::get<shared_ptr<char>>(channel_res);
 
-  if (PQgetisnull(enqueue_res.get(), 0, 0) == 1)
-    return variant<string, Uuid>("enqueueing returned unexpected null");
-
-  Uuid job(string(PQgetvalue(enqueue_res.get(), 0, 0)));
-
-  return variant<string, Uuid>(Uuid(job));
+  auto pipeline_res = remote_build::postgres::exec_pipeline(
+      conn,
+      {
+          remote_build::postgres::Query{
+              .stmt = "SELECT @schema@.enqueue_job("
+                      "$1::@schema@.drv_filename, $2::@schema@.textword, "
+                      "$3::@schema@.textword[], $4)",
+              .params =
+                  {
+                      remote_build::postgres::text_param(
+                          string(reqs.drv_path.to_string())),
+                      remote_build::postgres::text_param(reqs.needed_system),
+                      remote_build::postgres::text_array_param(
+                          reqs.required_features),
+                      remote_build::postgres::uuid_param(job),
+                  },
+          },
+          remote_build::postgres::Query{
+              .stmt = "SELECT @schema@.subscribe_job($1)",
+              .params = {remote_build::postgres::uuid_param(job)},
+          },
+          remote_build::postgres::Query{
+              .stmt = "LISTEN " + string(channel.get()),
+              .params = {},
+          },
+          remote_build::postgres::Query{
+              .stmt = dequeue::select_events.stmt,
+              .params = {remote_build::postgres::uuid_param(job),
+                         remote_build::postgres::int8_param(0)},
+          },
+      });
+
+  if (std::holds_alternative<string>(pipeline_res))
+    return variant<string, Enqueued>("enqueueing job: " +
+                                     std::get<string>(pipeline_res));
+
+  auto &results = std::get<vector<shared_ptr<PGresult>>>(pipeline_res);
+
+  auto seed = dequeue::events_of(results[3].get());
+
+  if (std::holds_alternative<string>(seed))
+    return variant<string, Enqueued>(std::get<string>(seed));
+
+  return variant<string, Enqueued>(Enqueued{
+      .job = job,
+      .seed = std::get<std::queue<ListenResult>>(seed),
+  });
 }
 
 variant<string, monostate> cancel_job(PGconn *conn, Uuid const &job) {
-  auto escaped_id = remote_build::postgres::escape_uuid(job);
-
-  char *params[1] = {escaped_id.data()};
-
-  auto res = remote_build::postgres::exec_params(
-      conn, "SELECT @schema@.cancel_job($1::uuid)", 1, params);
+  auto res = remote_build::postgres::exec_prepared(
+      conn, select_cancel_job, {remote_build::postgres::uuid_param(job)});
 
   if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
     return variant<string, monostate>(
@@ -63,19 +92,13 @@ variant<string, monostate>
 add_inputs_and_outputs(PGconn *conn, Uuid const &job,
                        nix::StorePathSet const &inputs,
                        nix::StringSet const &wanted_outputs) {
-  auto escaped_id = remote_build::postgres::escape_uuid(job);
-
-  auto inputs_arr = remote_build::postgres::to_sql_array(inputs);
-
-  auto outputs_arr = remote_build::postgres::to_sql_array(wanted_outputs);
-
-  char *params[3] = {escaped_id.data(), inputs_arr.data(), outputs_arr.data()};
-
-  auto res = remote_build::postgres::exec_params(
-      conn,
-      "SELECT @schema@.add_inputs_and_outputs("
-      "$1::uuid, $2::@schema@.output_path[], $3::@schema@.textword[])",
-      3, params);
+  auto res = remote_build::postgres::exec_prepared(
+      conn, select_add_inputs_and_outputs,
+      {
+          remote_build::postgres::uuid_param(job),
+          remote_build::postgres::text_array_param(inputs),
+          remote_build::postgres::text_array_param(wanted_outputs),
+      });
 
   if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
     return variant<string, monostate>(remote_build::postgres::err_msg(
@@ -6,6 +6,7 @@
 using nix::fmt;
 using nix::get;
 using nix::logger;
+using nix::Verbosity::lvlDebug;
 using nix::Verbosity::lvlVomit;
 
 namespace remote_build {
@@ -20,6 +21,8 @@ string err_msg(Error e) {
       [](dequeue::WrongChannel e) { return e.msg(); },
       [](dequeue::EscapingChannel e) { return e.msg(); },
       [](dequeue::NoMessages e) { return e.msg; },
+      [](dequeue::ConnectionLost e) { return e.msg(); },
+      [](dequeue::FetchingPayloads e) { return e.msg(); },
   };
 
   return visit(handle, e);
@@ -34,8 +37,38 @@ listen_channel(postgres::ConnectionParams const &conn_params,
   if (std::holds_alternative<string>(conn_res))
     return variant<string, Events>(get<string>(conn_res));
 
-  auto conn = get<shared_ptr<PGconn>>(conn_res);
+  return listen_channel(get<shared_ptr<PGconn>>(conn_res), channel_ident);
+}
+
+variant<string, Events> listen_channel(postgres::Pool &pool,
+                                       const string &channel_ident) {
+  auto conn_res = pool.get();
+
+  if (std::holds_alternative<string>(conn_res))
+    return variant<string, Events>(get<string>(conn_res));
+
+  auto pooled = get<shared_ptr<PGconn>>(conn_res);
+
+  auto conn = shared_ptr<PGconn>(pooled.get(), [&pool, pooled](PGconn *conn) {
+    // A reactor only lets go of a connection it made non-blocking once it
+    // broke or stopped answering, with a ping maybe still in flight, which
+    // UNLISTEN would wait for
+    if (PQisnonblocking(conn)) {
+      pool.discard(conn);
+
+      return;
+    }
 
+    postgres::exec(conn, "UNLISTEN *");
+
+    postgres::collect_notifications(conn);
+  });
+
+  return listen_channel(std::move(conn), channel_ident);
+}
+
+variant<string, Events> listen_channel(shared_ptr<PGconn> conn,
+                                       const string &channel_ident) {
   auto channel_res =
       postgres::escape_identifier(conn.get(), string(channel_ident));
 
@@ -56,75 +89,318 @@ listen_channel(postgres::ConnectionParams const &conn_params,
     return variant<string, Events>(Events(std::move(conn), channel_ident));
 }
 
-NonEmptyListenResults await_events(PGconn *conn, string const &on_channel) {
-  auto poll_res = postgres::poll_socket_ready(conn);
+NonEmptyListenResults await_events(PGconn *conn, string const &on_channel,
+                                   int timeout_ms) {
+  // Queries sharing conn may have read notifications off the socket already
+  auto notifications = postgres::collect_notifications(conn);
 
-  if (std::holds_alternative<postgres::PollingError>(poll_res))
-    return NonEmptyListenResults::singleton(ListenResult(
-        Error(PollingError(get<postgres::PollingError>(poll_res)))));
+  if (notifications.empty()) {
+    auto poll_res = postgres::poll_socket_ready(conn, timeout_ms);
 
-  if (PQconsumeInput(conn) == 0)
-    return NonEmptyListenResults::singleton(ListenResult(
-        Error(ConsumingInput(postgres::err_msg(conn, "consuming input")))));
+    if (std::holds_alternative<postgres::PollingError>(poll_res))
+      return NonEmptyListenResults::singleton(ListenResult(
+          Error(PollingError(get<postgres::PollingError>(poll_res)))));
 
-  std::queue<ListenResult> res;
+    if (PQconsumeInput(conn) == 0)
+      return NonEmptyListenResults::singleton(ListenResult(
+          Error(ConsumingInput(postgres::err_msg(conn, "consuming input")))));
+
+    notifications = postgres::collect_notifications(conn);
+  }
+
+  auto res = hydrate(conn, parse_notifications(notifications, on_channel));
+
+  if (res.empty()) {
+    return NonEmptyListenResults::singleton(ListenResult(Error(NoMessages{})));
+
+  } else {
+    auto head = res.front();
+
+    res.pop();
+
+    return NonEmptyListenResults{
+        .head = head,
+        .tail = res,
+    };
+  }
+}
+
+static bool timed_out(ListenResult const &res) {
+  if (!std::holds_alternative<Error>(res) ||
+      !std::holds_alternative<PollingError>(get<Error>(res)))
+    return false;
+
+  auto &pg_err = get<PollingError>(get<Error>(res)).pg_err;
+
+  return std::holds_alternative<postgres::PollingTimedOut>(pg_err);
+}
+
+void QueueState::advance() {
+  auto timeout_ms =
+      this->timeout
+          ? int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    *this->timeout)
+                    .count())
+          : -1;
+
+  while (true) {
+    if (this->queue->empty()) {
+      auto next = await_events(this->conn, this->channel_ident, timeout_ms);
+
+      this->queue->push(next.head);
+
+      for (; !next.tail.empty(); next.tail.pop())
+        this->queue->push(next.tail.front());
+    }
+
+    auto res = this->queue->front();
+
+    this->queue->pop();
+
+    // Quiet is fine as long as the server still answers. A dead peer
+    // without a reset otherwise leaves the socket silent forever.
+    auto quiet = timed_out(res);
+
+    if (quiet && postgres::probe(this->conn, *this->timeout))
+      continue;
+
+    if (std::holds_alternative<Error>(res) && this->job &&
+        (quiet || PQstatus(this->conn) == CONNECTION_BAD)) {
+      debug("lost connection listening to %s: %s", this->channel_ident,
+            err_msg(get<Error>(res)));
+
+      auto caught_up = this->catch_up();
+
+      if (std::holds_alternative<string>(caught_up)) {
+        this->curr = std::make_shared<ListenResult>(
+            Error(ConnectionLost(get<string>(caught_up))));
+
+        return;
+      }
+
+      // Whatever was left is older than what was just read
+      this->queue = std::make_unique<std::queue<ListenResult>>(
+          std::move(get<std::queue<ListenResult>>(caught_up)));
+
+      continue;
+    }
+
+    if (std::holds_alternative<event::Event>(res)) {
+      auto seq = event::plain(get<event::Event>(res)).seq;
+
+      if (seq <= this->seq)
+        continue;
+
+      this->seq = seq;
+    }
+
+    this->curr = std::make_shared<ListenResult>(res);
+
+    return;
+  }
+}
+
+variant<string, std::queue<ListenResult>> QueueState::catch_up() {
+  auto reconnect_res = postgres::reconnect(this->conn);
+
+  if (std::holds_alternative<string>(reconnect_res))
+    return get<string>(reconnect_res);
+
+  auto channel_res =
+      postgres::escape_identifier(this->conn, this->channel_ident);
+
+  if (std::holds_alternative<string>(channel_res))
+    return get<string>(channel_res);
+
+  auto listen_stmt =
+      "LISTEN " + string(get<shared_ptr<char>>(channel_res).get());
 
-  for (auto &notification : postgres::collect_notifications(conn)) {
+  auto res = postgres::exec(this->conn, listen_stmt);
+
+  if (PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+    return postgres::err_msg(res.get(), "listening again");
+
+  // Only after listening, so that nothing falls in between
+  return get_events(this->conn, *this->job, this->seq);
+}
+
+std::queue<Notified>
+parse_notifications(vector<shared_ptr<PGnotify>> const &notifications,
+                    string const &on_channel) {
+  std::queue<Notified> res;
+
+  for (auto &notification : notifications) {
     auto channel = string(notification->relname);
 
     vomit("got notification on %s, from pid %d", channel, notification->be_pid);
 
     if (channel == on_channel)
       try {
-        event::Fields<json> fields(json::parse(notification->extra));
-
-        auto evt = event::parse(fields);
-
-        if (std::holds_alternative<string>(evt))
-          res.push(ListenResult(Error(ParsingEvent(get<string>(evt)))));
-
-        else
-          res.push(ListenResult(get<event::Event>(evt)));
+        for (auto &fields : event::batch(json::parse(notification->extra)))
+          res.push(Notified(fields));
 
       } catch (json::exception &e) {
-        res.push(ListenResult(Error(
+        res.push(Notified(Error(
             JsonDecodeError(string(notification->extra),
                             "failed decoding event: " + string(e.what())))));
+
+      } catch (std::invalid_argument &e) {
+        res.push(Notified(Error(ParsingEvent(e.what()))));
       }
 
     else
-      res.push(ListenResult(Error(WrongChannel(channel))));
+      res.push(Notified(Error(WrongChannel(channel))));
   }
 
-  if (res.empty()) {
-    return NonEmptyListenResults::singleton(ListenResult(Error(NoMessages{})));
+  return res;
+}
 
-  } else {
-    auto head = res.front();
+static postgres::Prepared const select_payloads{
+    .name = "get_payloads",
+    .stmt = "SELECT * FROM ROWS FROM (@schema@.get_payloads($1, $2, $3))",
+};
 
-    res.pop();
+std::queue<ListenResult> hydrate(PGconn *conn, std::queue<Notified> notified) {
+  map<int64_t, json> fetched;
 
-    return NonEmptyListenResults{
-        .head = head,
-        .tail = res,
-    };
+  vector<int64_t> seqs;
+
+  vector<Uuid> jobs;
+
+  vector<string> names;
+
+  for (auto pending = notified; !pending.empty(); pending.pop()) {
+    if (!std::holds_alternative<event::Fields<json>>(pending.front()))
+      continue;
+
+    auto &fields = get<event::Fields<json>>(pending.front());
+
+    if (!fields.payload.is_null() || fetched.count(fields.seq) > 0)
+      continue;
+
+    fetched.emplace(fields.seq, json());
+
+    seqs.push_back(fields.seq);
+
+    jobs.push_back(fields.job);
+
+    names.push_back(fields.name);
+  }
+
+  optional<string> fetch_err;
+
+  if (!seqs.empty()) {
+    auto res = postgres::exec_prepared(conn, select_payloads,
+                                       {postgres::int8_array_param(seqs),
+                                        postgres::uuid_array_param(jobs),
+                                        postgres::text_array_param(names)});
+
+    if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+      fetch_err = postgres::err_msg(res.get());
+
+    for (int i = 0; !fetch_err && i < PQntuples(res.get()); i++) {
+      auto value = [&](int j) {
+        return string(PQgetvalue(res.get(), i, j),
+                      PQgetlength(res.get(), i, j));
+      };
+
+      auto seq = postgres::int8_value(value(0));
+
+      auto payload = postgres::jsonb_value(value(1));
+
+      if (std::holds_alternative<string>(seq))
+        fetch_err = get<string>(seq);
+
+      else if (std::holds_alternative<string>(payload))
+        fetch_err = get<string>(payload);
+
+      else
+        fetched.insert_or_assign(get<int64_t>(seq), get<json>(payload));
+    }
+  }
+
+  std::queue<ListenResult> res;
+
+  for (; !notified.empty(); notified.pop()) {
+    if (std::holds_alternative<Error>(notified.front())) {
+      res.push(ListenResult(get<Error>(notified.front())));
+
+      continue;
+    }
+
+    auto fields = get<event::Fields<json>>(notified.front());
+
+    if (fields.payload.is_null()) {
+      auto found = fetched.find(fields.seq);
+
+      if (found != fetched.end())
+        fields.payload = found->second;
+    }
+
+    if (fields.payload.is_null()) {
+      res.push(ListenResult(Error(FetchingPayloads(
+          fetch_err ? *fetch_err
+                    : nix::fmt("no payload for %s of %s", fields.name,
+                               fields.job.to_string())))));
+
+      continue;
+    }
+
+    auto evt = event::parse(fields);
+
+    if (std::holds_alternative<string>(evt))
+      res.push(ListenResult(Error(ParsingEvent(get<string>(evt)))));
+
+    else
+      res.push(ListenResult(get<event::Event>(evt)));
   }
+
+  return res;
+}
+
+postgres::Prepared const select_events{
+    .name = "get_events",
+    .stmt = "SELECT * FROM ROWS FROM (@schema@.get_events($1, $2))",
+};
+
+static postgres::Prepared const select_missed_events{
+    .name = "get_missed_events",
+    .stmt = "SELECT * FROM ROWS FROM (@schema@.get_missed_events($1, $2))",
+};
+
+GetEventsResult get_events(PGconn *conn, Uuid const &job, int64_t after) {
+  auto res = postgres::exec_prepared(
+      conn, select_events,
+      {postgres::uuid_param(job), postgres::int8_param(after)});
+
+  return events_of(res.get());
 }
 
-GetEventsResult get_events(PGconn *conn, Uuid const &job) {
-  auto id = postgres::escape_uuid(job);
+GetEventsResult get_missed_events(PGconn *conn,
+                                  map<Uuid, int64_t> const &cursors) {
+  vector<Uuid> jobs;
+
+  vector<int64_t> afters;
 
-  char *params[1] = {id.data()};
+  for (auto &[job, after] : cursors) {
+    jobs.push_back(job);
 
-  auto res = postgres::exec_params(
-      conn, "SELECT * FROM ROWS FROM (@schema@.get_events($1::uuid))", 1,
-      params);
+    afters.push_back(after);
+  }
+
+  auto res = postgres::exec_prepared(conn, select_missed_events,
+                                     {postgres::uuid_array_param(jobs),
+                                      postgres::int8_array_param(afters)});
+
+  return events_of(res.get());
+}
 
-  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
-    return GetEventsResult(postgres::err_msg(res.get(), "getting events"));
+GetEventsResult events_of(PGresult *res) {
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    return GetEventsResult(postgres::err_msg(res, "getting events"));
 
   auto query_res =
-      postgres::collect_tuples<event::Event, 4>(res.get(), event::from_row);
+      postgres::collect_tuples<event::Event, 5>(res, event::from_row);
 
   auto result = std::queue<ListenResult>();
 
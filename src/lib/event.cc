@@ -23,6 +23,8 @@ ParseResult parse(Fields<json> const &fields) {
       return ParseResult(Fields(fields, InputsOutputs(fields.payload)));
     } else if (fields.name == "fail") {
       return ParseResult(Fields(fields, BuildError(fields.payload)));
+    } else if (fields.name == "succeed") {
+      return ParseResult(Fields(fields, S{}));
     } else {
       return ParseResult(fmt("unexpected event name: %s", fields.name));
     }
@@ -32,7 +34,19 @@ ParseResult parse(Fields<json> const &fields) {
   }
 }
 
-postgres::FromRowResult<Event> from_row(std::array<optional<string>, 4> tup) {
+vector<Fields<json>> batch(json const &j) {
+  if (!j.is_array())
+    return {Fields<json>(j)};
+
+  vector<Fields<json>> res;
+
+  for (auto &e : j)
+    res.push_back(Fields<json>(e));
+
+  return res;
+}
+
+postgres::FromRowResult<Event> from_row(std::array<optional<string>, 5> tup) {
   auto f = Fields<json>::from_row(tup);
 
   if (std::holds_alternative<postgres::FromRowError>(f))
@@ -50,22 +64,25 @@ postgres::FromRowResult<Event> from_row(std::array<optional<string>, 4> tup) {
 Fields<monostate> plain(Event const &event) {
   auto handle = overloaded{
       [](const Start &e) {
-        return Fields<monostate>(e.ts, e.name, e.job.val, monostate());
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
       },
       [](const Cancel &e) {
-        return Fields<monostate>(e.ts, e.name, e.job.val, monostate());
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
       },
       [](const NoMachineAvailable &e) {
-        return Fields<monostate>(e.ts, e.name, e.job.val, monostate());
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
       },
       [](const Accept &e) {
-        return Fields<monostate>(e.ts, e.name, e.job.val, monostate());
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
       },
       [](const AddInputsAndOutputs &e) {
-        return Fields<monostate>(e.ts, e.name, e.job.val, monostate());
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
       },
       [](const Fail &e) {
-        return Fields<monostate>(e.ts, e.name, e.job.val, monostate());
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
+      },
+      [](const Succeed &e) {
+        return Fields<monostate>(e.seq, e.ts, e.name, e.job, monostate());
       },
   };
 
@@ -12,20 +12,17 @@ using nlohmann::json;
 namespace remote_build {
 namespace job {
 
-variant<string, Job> get(PGconn *conn, Uuid const &id) {
-
-  char const *select_job_stmt =
-      "SELECT * FROM ROWS FROM (@schema@.get_job($1::uuid))";
-
-  auto escaped = postgres::escape_uuid(id);
-
-  char *params[1] = {escaped.data()};
+static postgres::Prepared const get_job{
+    .name = "get_job",
+    .stmt = "SELECT * FROM ROWS FROM (@schema@.get_job($1))",
+};
 
-  auto res = postgres::exec_params(conn, select_job_stmt, 1, params);
+variant<string, Job> get(PGconn *conn, Uuid const &id) {
+  auto res = postgres::exec_prepared(conn, get_job, {postgres::uuid_param(id)});
 
   if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
-    return variant<string, Job>(
-        postgres::err_msg(res.get(), nix::fmt("getting job %s", id.val)));
+    return variant<string, Job>(postgres::err_msg(
+        res.get(), nix::fmt("getting job %s", id.to_string())));
 
   auto job_res = from_postgres(res.get());
 
@@ -49,10 +46,19 @@ variant<string, Job> from_postgres(PGresult *res) {
       PQgetisnull(res, 0, 2) == 1)
     return variant<string, Job>("getting job returned unexpected null");
 
-  auto toks = nix::tokenizeString<set<string>>(PQgetvalue(res, 0, 2), "{},");
+  auto features = postgres::text_array_value(
+      string(PQgetvalue(res, 0, 2), PQgetlength(res, 0, 2)));
+
+  if (std::holds_alternative<string>(features))
+    return variant<string, Job>("getting job system features: " +
+                                std::get<string>(features));
+
+  auto &feature_list = std::get<vector<string>>(features);
 
   return variant<string, Job>(
-      Job(PQgetvalue(res, 0, 0), PQgetvalue(res, 0, 1), toks));
+      Job(string(PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0)),
+          string(PQgetvalue(res, 0, 1), PQgetlength(res, 0, 1)),
+          set<string>(feature_list.begin(), feature_list.end())));
 }
 
 } // namespace job
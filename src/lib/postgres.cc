@@ -1,13 +1,26 @@
 #include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 
+#include <endian.h>
+
 #include <sys/poll.h>
 #include <sys/types.h>
 
+#include <libpq-events.h>
+
+#include <nix/logging.hh>
+
 #include <concat-strings.hh>
 #include <postgres.hh>
 
+using nix::fmt;
+using nix::logger;
+using nix::Verbosity::lvlDebug;
+
 using std::monostate;
 using std::ostringstream;
 using std::variant;
@@ -15,6 +28,42 @@ using std::variant;
 namespace remote_build {
 namespace postgres {
 
+/// Keeps the names of the statements prepared on a connection.
+static int track_prepared(PGEventId id, void *info, void *) {
+  switch (id) {
+  case PGEVT_REGISTER: {
+    auto conn = static_cast<PGEventRegister *>(info)->conn;
+
+    return PQsetInstanceData(conn, track_prepared, new set<string>());
+  }
+
+  case PGEVT_CONNRESET: {
+    auto conn = static_cast<PGEventConnReset *>(info)->conn;
+
+    static_cast<set<string> *>(PQinstanceData(conn, track_prepared))->clear();
+
+    return 1;
+  }
+
+  case PGEVT_CONNDESTROY: {
+    auto conn = static_cast<PGEventConnDestroy *>(info)->conn;
+
+    delete static_cast<set<string> *>(PQinstanceData(conn, track_prepared));
+
+    return 1;
+  }
+
+  default:
+    return 1;
+  }
+}
+
+/// A secure search path, and UTC so that timestamps in notifications and
+/// in show_timestamp look the same.
+static char const *const setup_session =
+    "SELECT pg_catalog.set_config('search_path', '', false), "
+    "pg_catalog.set_config('TimeZone', 'UTC', false)";
+
 variant<string, shared_ptr<PGconn>> connect(ConnectionParams const &params) {
   char const *user_key = "user";
   char const *host_key = "host";
@@ -33,16 +82,122 @@ variant<string, shared_ptr<PGconn>> connect(ConnectionParams const &params) {
     return variant<string, shared_ptr<PGconn>>{
         err_msg(conn.get(), "connecting to postgres")};
 
-  auto res = exec(conn.get(),
-                  "SELECT pg_catalog.set_config('search_path', '', false)");
+  if (PQregisterEventProc(conn.get(), track_prepared, "track_prepared",
+                          NULL) == 0)
+    return variant<string, shared_ptr<PGconn>>(
+        "tracking prepared statements: out of memory");
+
+  auto res = exec(conn.get(), setup_session);
 
   if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
     return variant<string, shared_ptr<PGconn>>(
-        err_msg(res.get(), "setting secure search path"));
+        err_msg(res.get(), "setting up session"));
 
   return variant<string, shared_ptr<PGconn>>(conn);
 }
 
+variant<string, monostate> reconnect(PGconn *conn) {
+  PQreset(conn);
+
+  if (PQstatus(conn) != CONNECTION_OK)
+    return variant<string, monostate>(
+        err_msg(conn, "reconnecting to postgres"));
+
+  auto res = exec(conn, setup_session);
+
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    return variant<string, monostate>(
+        err_msg(res.get(), "setting up session"));
+
+  return variant<string, monostate>(monostate());
+}
+
+variant<string, shared_ptr<PGconn>> Pool::get() {
+  shared_ptr<PGconn> conn;
+
+  bool stale = false;
+
+  {
+    auto c(this->conns.lock());
+
+    while (c->idle.empty() && c->open >= this->max_size)
+      c.wait(this->returned);
+
+    if (c->idle.empty()) {
+      c->open++;
+
+    } else {
+      auto idle = c->idle.back();
+
+      c->idle.pop_back();
+
+      conn = idle.conn;
+
+      stale = std::chrono::steady_clock::now() - idle.since >
+              this->check_after;
+    }
+  }
+
+  if (conn && stale) {
+    auto res = exec(conn.get(), "SELECT 1");
+
+    if (PQresultStatus(res.get()) != PGRES_TUPLES_OK) {
+      debug("pooled connection failed health check: %s", err_msg(res.get()));
+
+      conn.reset();
+    }
+  }
+
+  if (conn && PQstatus(conn.get()) != CONNECTION_OK)
+    conn.reset();
+
+  if (!conn) {
+    auto conn_res = connect(this->params);
+
+    if (std::holds_alternative<string>(conn_res)) {
+      this->conns.lock()->open--;
+
+      this->returned.notify_one();
+
+      return conn_res;
+    }
+
+    conn = std::get<shared_ptr<PGconn>>(conn_res);
+  }
+
+  return variant<string, shared_ptr<PGconn>>(shared_ptr<PGconn>(
+      conn.get(), [this, conn](PGconn *) { this->put(conn); }));
+}
+
+void Pool::discard(PGconn *conn) {
+  this->conns.lock()->discarded.insert(conn);
+}
+
+void Pool::put(shared_ptr<PGconn> conn) {
+  auto healthy = PQstatus(conn.get()) == CONNECTION_OK &&
+                 PQtransactionStatus(conn.get()) == PQTRANS_IDLE &&
+                 PQpipelineStatus(conn.get()) == PQ_PIPELINE_OFF &&
+                 PQisnonblocking(conn.get()) == 0;
+
+  {
+    auto c(this->conns.lock());
+
+    if (c->discarded.erase(conn.get()) > 0)
+      healthy = false;
+
+    if (healthy)
+      c->idle.push_back(Idle{
+          .conn = conn,
+          .since = std::chrono::steady_clock::now(),
+      });
+
+    else
+      c->open--;
+  }
+
+  this->returned.notify_one();
+}
+
 string show_conn_string(PGconn *conn) {
   auto conn_info =
       shared_ptr<PQconninfoOption>(PQconninfo(conn), PQconninfoFree);
@@ -96,6 +251,384 @@ shared_ptr<PGresult> exec_params(PGconn *conn, string const &stmt, int n_params,
                               PQclear);
 }
 
+static void put_int32(string &out, uint32_t n) {
+  n = htobe32(n);
+
+  out.append(reinterpret_cast<char const *>(&n), sizeof n);
+}
+
+static optional<uint32_t> get_int32(string const &in, size_t &pos) {
+  uint32_t n;
+
+  if (in.size() - pos < sizeof n)
+    return std::nullopt;
+
+  std::memcpy(&n, in.data() + pos, sizeof n);
+
+  pos += sizeof n;
+
+  return be32toh(n);
+}
+
+Param int4_param(int32_t n) {
+  uint32_t be = htobe32(uint32_t(n));
+
+  return Param{
+      .type = oid::int4,
+      .value = string(reinterpret_cast<char const *>(&be), sizeof be),
+  };
+}
+
+Param int8_param(int64_t n) {
+  uint64_t be = htobe64(uint64_t(n));
+
+  return Param{
+      .type = oid::int8,
+      .value = string(reinterpret_cast<char const *>(&be), sizeof be),
+  };
+}
+
+Param uuid_param(Uuid const &u) {
+  return Param{
+      .type = oid::uuid,
+      .value = string(u.bytes.begin(), u.bytes.end()),
+  };
+}
+
+Param text_param(string const &s) {
+  return Param{
+      .type = oid::text,
+      .value = s,
+  };
+}
+
+/// A one dimensional array without nulls, its elements already encoded.
+static Param array_param(Oid array_type, Oid element_type,
+                         vector<string> const &v) {
+  string out;
+
+  put_int32(out, v.empty() ? 0 : 1); // dimensions
+
+  put_int32(out, 0); // no nulls
+
+  put_int32(out, element_type);
+
+  if (!v.empty()) {
+    put_int32(out, v.size());
+
+    put_int32(out, 1); // lower bound
+  }
+
+  for (auto &el : v) {
+    put_int32(out, el.size());
+
+    out.append(el);
+  }
+
+  return Param{
+      .type = array_type,
+      .value = out,
+  };
+}
+
+Param text_array_param(vector<string> const &v) {
+  return array_param(oid::text_array, oid::text, v);
+}
+
+Param text_array_param(set<string> const &v) {
+  return text_array_param(vector<string>(v.begin(), v.end()));
+}
+
+Param text_array_param(nix::StorePathSet const &s) {
+  vector<string> v;
+
+  std::transform(s.begin(), s.end(), std::back_inserter(v),
+                 [](nix::StorePath const &p) { return string(p.to_string()); });
+
+  return text_array_param(v);
+}
+
+Param uuid_array_param(vector<Uuid> const &v) {
+  vector<string> els;
+
+  for (auto &u : v)
+    els.push_back(uuid_param(u).value);
+
+  return array_param(oid::uuid_array, oid::uuid, els);
+}
+
+Param int8_array_param(vector<int64_t> const &v) {
+  vector<string> els;
+
+  for (auto n : v)
+    els.push_back(int8_param(n).value);
+
+  return array_param(oid::int8_array, oid::int8, els);
+}
+
+shared_ptr<PGresult> exec_prepared(PGconn *conn, Prepared const &stmt,
+                                   vector<Param> const &params) {
+  vector<Oid> types;
+
+  vector<char const *> values;
+
+  vector<int> lengths;
+
+  vector<int> formats(params.size(), 1);
+
+  for (auto &param : params) {
+    types.push_back(param.type);
+
+    values.push_back(param.value.data());
+
+    lengths.push_back(param.value.size());
+  }
+
+  auto prepared =
+      static_cast<set<string> *>(PQinstanceData(conn, track_prepared));
+
+  if (prepared == NULL)
+    return shared_ptr<PGresult>(PQexecParams(conn, stmt.stmt.data(),
+                                             params.size(), types.data(),
+                                             values.data(), lengths.data(),
+                                             formats.data(), 1),
+                                PQclear);
+
+  // A statement deallocated behind our back is prepared again, once
+  for (int attempt = 0;; attempt++) {
+    if (prepared->find(stmt.name) == prepared->end()) {
+      auto res = shared_ptr<PGresult>(PQprepare(conn, stmt.name.data(),
+                                                stmt.stmt.data(),
+                                                params.size(), types.data()),
+                                      PQclear);
+
+      if (PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+        return res;
+
+      prepared->insert(stmt.name);
+    }
+
+    auto res = shared_ptr<PGresult>(
+        PQexecPrepared(conn, stmt.name.data(), params.size(), values.data(),
+                       lengths.data(), formats.data(), 1),
+        PQclear);
+
+    auto state = PQresultErrorField(res.get(), PG_DIAG_SQLSTATE);
+
+    // invalid_sql_statement_name
+    if (attempt > 0 || state == NULL || string(state) != "26000")
+      return res;
+
+    prepared->erase(stmt.name);
+  }
+}
+
+variant<string, vector<shared_ptr<PGresult>>>
+exec_pipeline(PGconn *conn, vector<Query> const &queries) {
+  typedef variant<string, vector<shared_ptr<PGresult>>> PipelineResult;
+
+  if (PQenterPipelineMode(conn) == 0)
+    return PipelineResult(err_msg(conn, "entering pipeline mode"));
+
+  // Leaves pipeline mode if nothing is pending any more. Otherwise the
+  // connection stays in it, and the pool closes it.
+  auto fail = [conn](string const &msg) {
+    PQexitPipelineMode(conn);
+
+    return PipelineResult(msg);
+  };
+
+  for (auto &query : queries) {
+    vector<Oid> types;
+
+    vector<char const *> values;
+
+    vector<int> lengths;
+
+    vector<int> formats(query.params.size(), 1);
+
+    for (auto &param : query.params) {
+      types.push_back(param.type);
+
+      values.push_back(param.value.data());
+
+      lengths.push_back(param.value.size());
+    }
+
+    if (PQsendQueryParams(conn, query.stmt.data(), query.params.size(),
+                          types.data(), values.data(), lengths.data(),
+                          formats.data(), 1) == 0)
+      return fail(err_msg(conn, "sending pipelined query"));
+  }
+
+  if (PQpipelineSync(conn) == 0)
+    return fail(err_msg(conn, "syncing pipeline"));
+
+  vector<shared_ptr<PGresult>> results;
+
+  optional<string> err;
+
+  for (size_t i = 0; i < queries.size(); i++) {
+    auto res = shared_ptr<PGresult>(PQgetResult(conn), PQclear);
+
+    if (!res)
+      return fail(err_msg(conn, "reading pipelined results"));
+
+    auto status = PQresultStatus(res.get());
+
+    if (!err && (status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE))
+      err = err_msg(res.get(), "running pipelined query");
+
+    results.push_back(res);
+
+    // Each query's results end with a NULL
+    while (auto rest = PQgetResult(conn))
+      PQclear(rest);
+  }
+
+  auto sync = shared_ptr<PGresult>(PQgetResult(conn), PQclear);
+
+  if (!sync || PQresultStatus(sync.get()) != PGRES_PIPELINE_SYNC)
+    return fail(err_msg(conn, "expected end of pipeline"));
+
+  if (PQexitPipelineMode(conn) == 0)
+    return PipelineResult(err_msg(conn, "leaving pipeline mode"));
+
+  if (err)
+    return PipelineResult(*err);
+
+  return PipelineResult(results);
+}
+
+variant<string, int64_t> int8_value(string const &bytes) {
+  uint64_t n;
+
+  if (bytes.size() != sizeof n)
+    return variant<string, int64_t>(
+        nix::fmt("expected an 8 byte int8, got %d bytes", bytes.size()));
+
+  std::memcpy(&n, bytes.data(), sizeof n);
+
+  return variant<string, int64_t>(int64_t(be64toh(n)));
+}
+
+variant<string, Uuid> uuid_value(string const &bytes) {
+  if (bytes.size() != 16)
+    return variant<string, Uuid>(
+        nix::fmt("expected a 16 byte uuid, got %d bytes", bytes.size()));
+
+  return variant<string, Uuid>(Uuid::from_bytes(bytes.data()));
+}
+
+variant<string, Timestamp> timestamptz_value(string const &bytes) {
+  uint64_t n;
+
+  if (bytes.size() != sizeof n)
+    return variant<string, Timestamp>(
+        nix::fmt("expected an 8 byte timestamptz, got %d bytes", bytes.size()));
+
+  std::memcpy(&n, bytes.data(), sizeof n);
+
+  // Microseconds since 2000-01-01 00:00:00 UTC
+  auto since_2000 = std::chrono::microseconds(int64_t(be64toh(n)));
+
+  return variant<string, Timestamp>(Timestamp(std::chrono::seconds(946684800)) +
+                                    since_2000);
+}
+
+variant<string, vector<string>> text_array_value(string const &bytes) {
+  size_t pos = 0;
+
+  auto dims = get_int32(bytes, pos);
+
+  auto flags = get_int32(bytes, pos);
+
+  auto type = get_int32(bytes, pos);
+
+  if (!dims || !flags || !type || *dims > 1)
+    return variant<string, vector<string>>(
+        "expected a one dimensional array");
+
+  vector<string> els;
+
+  if (*dims == 0)
+    return variant<string, vector<string>>(els);
+
+  auto size = get_int32(bytes, pos);
+
+  auto lower_bound = get_int32(bytes, pos);
+
+  if (!size || !lower_bound)
+    return variant<string, vector<string>>("truncated array header");
+
+  for (uint32_t i = 0; i < *size; i++) {
+    auto len = get_int32(bytes, pos);
+
+    if (!len || *len == uint32_t(-1))
+      return variant<string, vector<string>>("unexpected null in array");
+
+    if (bytes.size() - pos < *len)
+      return variant<string, vector<string>>("truncated array element");
+
+    els.emplace_back(bytes, pos, *len);
+
+    pos += *len;
+  }
+
+  return variant<string, vector<string>>(els);
+}
+
+variant<string, json> jsonb_value(string const &bytes) {
+  // Binary jsonb is a version byte followed by the text
+  if (bytes.empty() || bytes[0] != 1)
+    return variant<string, json>(string("unsupported jsonb format version"));
+
+  try {
+    return variant<string, json>(json::parse(bytes.substr(1)));
+
+  } catch (json::exception &e) {
+    return variant<string, json>(
+        nix::fmt("parsing jsonb: %s. got %s", e.what(), bytes.substr(1)));
+  }
+}
+
+string show_timestamp(Timestamp ts) {
+  auto secs = std::chrono::time_point_cast<std::chrono::seconds>(ts);
+
+  // Round down, also before the epoch
+  if (secs > ts)
+    secs -= std::chrono::seconds(1);
+
+  auto micros =
+      std::chrono::duration_cast<std::chrono::microseconds>(ts - secs).count();
+
+  auto t = std::chrono::system_clock::to_time_t(secs);
+
+  std::tm tm;
+
+  gmtime_r(&t, &tm);
+
+  char buf[64];
+
+  std::snprintf(buf, sizeof buf, "%04d-%02d-%02dT%02d:%02d:%02d",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                tm.tm_min, tm.tm_sec);
+
+  char frac[16];
+
+  std::snprintf(frac, sizeof frac, ".%06lld", static_cast<long long>(micros));
+
+  // Like postgres, without trailing zeros, nor the point if nothing is left
+  auto digits = string(frac);
+
+  digits.erase(digits.find_last_not_of('0') + 1);
+
+  if (digits == ".")
+    digits.clear();
+
+  return string(buf) + digits + "+00:00";
+}
+
 variant<string, shared_ptr<char>> escape_identifier(PGconn *conn,
                                                     string const &ident) {
   auto tmp = PQescapeIdentifier(conn, ident.data(), ident.length());
@@ -134,26 +667,7 @@ string err_msg(PollingError err) {
   return visit(show_err, err);
 };
 
-string to_sql_array(vector<string> const &v) {
-  return "{" + concat_strings::sep(v, ",") + "}";
-}
-
-string to_sql_array(set<string> const &v) {
-  return "{" + concat_strings::sep(v, ",") + "}";
-}
-
-string to_sql_array(nix::StorePathSet const &s) {
-  vector<string> v;
-
-  std::transform(s.begin(), s.end(), std::back_inserter(v),
-                 [](nix::StorePath const &p) { return string(p.to_string()); });
-
-  return "{" + concat_strings::sep(v, ",") + "}";
-}
-
-string escape_uuid(Uuid const &u) { return "{" + u.val + "}"; }
-
-PollingResult poll_socket_ready(PGconn *conn) {
+PollingResult poll_socket_ready(PGconn *conn, int timeout_ms) {
   auto sock = PQsocket(conn);
 
   if (sock < 0)
@@ -171,7 +685,7 @@ PollingResult poll_socket_ready(PGconn *conn) {
 
   pollfd poll_fds[1] = {to_poll};
 
-  auto n_poll_read = poll(poll_fds, 1, -1);
+  auto n_poll_read = poll(poll_fds, 1, timeout_ms);
 
   switch (n_poll_read) {
   case -1:
@@ -188,13 +702,15 @@ PollingResult poll_socket_ready(PGconn *conn) {
         PollingError(PollingUnexpectedNumResults(n_poll_read)));
   }
 
-  if (to_poll.revents & POLLERR) {
+  auto revents = poll_fds[0].revents;
+
+  if (revents & POLLERR) {
     return PollingResult(PollingError(PollingPollErr{}));
 
-  } else if (to_poll.revents & POLLHUP) {
+  } else if (revents & POLLHUP) {
     return PollingResult(PollingError(PollingPollHup{}));
 
-  } else if (to_poll.revents & POLLNVAL) {
+  } else if (revents & POLLNVAL) {
     return PollingResult(PollingError(PollingPollInval{}));
 
   } else {
@@ -202,6 +718,41 @@ PollingResult poll_socket_ready(PGconn *conn) {
   }
 }
 
+bool probe(PGconn *conn, std::chrono::steady_clock::duration timeout) {
+  if (PQsendQuery(conn, "SELECT 1") == 0)
+    return false;
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  auto ok = true;
+
+  while (true) {
+    while (!PQisBusy(conn)) {
+      auto res = PQgetResult(conn);
+
+      if (res == NULL)
+        return ok;
+
+      ok = ok && PQresultStatus(res) == PGRES_TUPLES_OK;
+
+      PQclear(res);
+    }
+
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now())
+                    .count();
+
+    if (left <= 0)
+      return false;
+
+    auto poll_res = poll_socket_ready(conn, int(left));
+
+    if (std::holds_alternative<PollingError>(poll_res) ||
+        PQconsumeInput(conn) == 0)
+      return false;
+  }
+}
+
 vector<shared_ptr<PGnotify>> collect_notifications(PGconn *conn) {
   vector<shared_ptr<PGnotify>> results;
 
@@ -0,0 +1,281 @@
+#include <cerrno>
+#include <cstring>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <nix/logging.hh>
+#include <nix/util.hh>
+
+#include <postgres.hh>
+#include <reactor.hh>
+
+using nix::fmt;
+using nix::logger;
+using nix::Verbosity::lvlDebug;
+using nix::Verbosity::lvlVomit;
+
+namespace remote_build {
+namespace reactor {
+
+Reactor::Reactor()
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      wake_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)), watches() {
+  if (epoll_fd < 0)
+    throw nix::SysError("creating epoll instance");
+
+  if (wake_fd < 0)
+    throw nix::SysError("creating eventfd");
+
+  epoll_event ev{};
+
+  ev.events = EPOLLIN;
+
+  ev.data.fd = wake_fd;
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+    throw nix::SysError("watching eventfd");
+}
+
+Reactor::~Reactor() {
+  close(wake_fd);
+
+  close(epoll_fd);
+}
+
+optional<string> Reactor::watch(shared_ptr<PGconn> conn,
+                                Clock::duration timeout, OnNotify on_notify,
+                                OnError on_error) {
+  if (PQsetnonblocking(conn.get(), 1) != 0)
+    return postgres::err_msg(conn.get(), "switching to non-blocking mode");
+
+  auto fd = PQsocket(conn.get());
+
+  if (fd < 0)
+    return string("watching a closed postgres connection");
+
+  this->watches.lock()->insert_or_assign(fd, Watch{
+                                                 .conn = conn,
+                                                 .timeout = timeout,
+                                                 .on_notify = on_notify,
+                                                 .on_error = on_error,
+                                                 .last_heard = Clock::now(),
+                                                 .pinged = std::nullopt,
+                                             });
+
+  epoll_event ev{};
+
+  ev.events = EPOLLIN;
+
+  ev.data.fd = fd;
+
+  if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    this->watches.lock()->erase(fd);
+
+    return fmt("watching postgres socket: %s", strerror(errno));
+  }
+
+  // The deadline may now be sooner than run() is waiting for
+  uint64_t one = 1;
+
+  if (write(this->wake_fd, &one, sizeof one) < 0)
+    debug("waking reactor: %s", strerror(errno));
+
+  return std::nullopt;
+}
+
+void Reactor::run() {
+  epoll_event events[64];
+
+  while (true) {
+    auto deadline = this->next_deadline();
+
+    int timeout_ms = -1;
+
+    if (deadline) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          *deadline - Clock::now());
+
+      timeout_ms = std::max<long long>(left.count(), 0) + 1;
+    }
+
+    auto n = epoll_wait(this->epoll_fd, events, 64, timeout_ms);
+
+    if (n < 0 && errno != EINTR)
+      throw nix::SysError("waiting for postgres sockets");
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == this->wake_fd) {
+        uint64_t count;
+
+        while (read(this->wake_fd, &count, sizeof count) > 0)
+          ;
+
+        continue;
+      }
+
+      this->handle_ready(events[i].data.fd, events[i].events);
+    }
+
+    this->handle_timeouts();
+  }
+}
+
+void Reactor::handle_ready(int fd, uint32_t events) {
+  shared_ptr<PGconn> conn;
+
+  OnNotify on_notify;
+
+  {
+    auto ws(this->watches.lock());
+
+    auto found = ws->find(fd);
+
+    if (found == ws->end())
+      return;
+
+    conn = found->second.conn;
+
+    on_notify = found->second.on_notify;
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+    return this->drop(fd, "postgres socket hung up");
+
+  if (events & EPOLLOUT && PQflush(conn.get()) == 0) {
+    epoll_event ev{};
+
+    ev.events = EPOLLIN;
+
+    ev.data.fd = fd;
+
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  if (!(events & EPOLLIN))
+    return;
+
+  if (PQconsumeInput(conn.get()) == 0)
+    return this->drop(fd, postgres::err_msg(conn.get(), "consuming input"));
+
+  bool answered = false;
+
+  // Only pings send queries on watched connections
+  while (PQisBusy(conn.get()) == 0) {
+    auto res = PQgetResult(conn.get());
+
+    if (res == NULL)
+      break;
+
+    answered = true;
+
+    PQclear(res);
+  }
+
+  {
+    auto ws(this->watches.lock());
+
+    auto found = ws->find(fd);
+
+    if (found != ws->end()) {
+      found->second.last_heard = Clock::now();
+
+      if (answered)
+        found->second.pinged = std::nullopt;
+    }
+  }
+
+  auto notifications = postgres::collect_notifications(conn.get());
+
+  if (!notifications.empty())
+    on_notify(notifications);
+}
+
+void Reactor::handle_timeouts() {
+  auto now = Clock::now();
+
+  vector<int> dead;
+
+  {
+    auto ws(this->watches.lock());
+
+    for (auto &[fd, watch] : *ws) {
+      if (watch.pinged) {
+        if (now - *watch.pinged >= watch.timeout)
+          dead.push_back(fd);
+
+      } else if (now - watch.last_heard >= watch.timeout) {
+        vomit("pinging quiet postgres connection %d", fd);
+
+        if (PQsendQuery(watch.conn.get(), "SELECT 1") == 0) {
+          dead.push_back(fd);
+
+          continue;
+        }
+
+        watch.pinged = now;
+
+        // Whatever did not fit in the socket buffer goes out when it drains
+        if (PQflush(watch.conn.get()) == 1) {
+          epoll_event ev{};
+
+          ev.events = EPOLLIN | EPOLLOUT;
+
+          ev.data.fd = fd;
+
+          epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+      }
+    }
+  }
+
+  for (auto fd : dead)
+    this->drop(fd, "postgres connection stopped responding");
+}
+
+optional<Clock::time_point> Reactor::next_deadline() {
+  optional<Clock::time_point> next;
+
+  auto ws(this->watches.lock());
+
+  for (auto &[fd, watch] : *ws) {
+    auto deadline = watch.pinged ? *watch.pinged + watch.timeout
+                                 : watch.last_heard + watch.timeout;
+
+    if (!next || deadline < *next)
+      next = deadline;
+  }
+
+  return next;
+}
+
+void Reactor::drop(int fd, string const &msg) {
+  optional<Watch> dropped;
+
+  {
+    auto ws(this->watches.lock());
+
+    auto found = ws->find(fd);
+
+    if (found == ws->end())
+      return;
+
+    dropped = std::move(found->second);
+
+    ws->erase(found);
+  }
+
+  epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+  // Releasing the connection may run its deleter, which must not hold up
+  // the other watches
+  auto on_error = std::move(dropped->on_error);
+
+  dropped.reset();
+
+  on_error(msg);
+}
+
+} // namespace reactor
+} // namespace remote_build
@@ -0,0 +1,112 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <uuid.hh>
+
+namespace remote_build {
+namespace uuid {
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+Uuid::Uuid(string const &s) : bytes() {
+  size_t i = 0;
+
+  for (auto &byte : bytes) {
+    // Dashes go after the 4th, 6th, 8th and 10th byte
+    if (i == 8 || i == 13 || i == 18 || i == 23)
+      if (i >= s.size() || s[i++] != '-')
+        throw std::invalid_argument("invalid uuid: " + s);
+
+    auto hi = i < s.size() ? hex_digit(s[i++]) : -1;
+
+    auto lo = i < s.size() ? hex_digit(s[i++]) : -1;
+
+    if (hi < 0 || lo < 0)
+      throw std::invalid_argument("invalid uuid: " + s);
+
+    byte = hi << 4 | lo;
+  }
+
+  if (i != s.size())
+    throw std::invalid_argument("invalid uuid: " + s);
+}
+
+Uuid Uuid::from_bytes(char const *data) {
+  Uuid u;
+
+  std::memcpy(u.bytes.data(), data, u.bytes.size());
+
+  return u;
+}
+
+Uuid Uuid::random() {
+  static thread_local std::random_device dev;
+
+  Uuid u;
+
+  for (size_t i = 0; i < u.bytes.size(); i += 4) {
+    auto r = dev();
+
+    std::memcpy(u.bytes.data() + i, &r, 4);
+  }
+
+  // RFC 4122 version 4, variant 1
+  u.bytes[6] = (u.bytes[6] & 0x0f) | 0x40;
+
+  u.bytes[8] = (u.bytes[8] & 0x3f) | 0x80;
+
+  return u;
+}
+
+Uuid Uuid::time_ordered() {
+  auto u = random();
+
+  uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+
+  // 48 bits of big-endian timestamp
+  for (size_t i = 0; i < 6; i++)
+    u.bytes[i] = ms >> (8 * (5 - i));
+
+  // RFC 9562 version 7, variant 1 is kept from random
+  u.bytes[6] = (u.bytes[6] & 0x0f) | 0x70;
+
+  return u;
+}
+
+string Uuid::to_string() const {
+  static char const digits[] = "0123456789abcdef";
+
+  string s;
+
+  s.reserve(36);
+
+  for (size_t i = 0; i < bytes.size(); i++) {
+    if (i == 4 || i == 6 || i == 8 || i == 10)
+      s.push_back('-');
+
+    s.push_back(digits[bytes[i] >> 4]);
+
+    s.push_back(digits[bytes[i] & 0xf]);
+  }
+
+  return s;
+}
+
+} // namespace uuid
+} // namespace remote_build
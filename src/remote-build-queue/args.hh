@@ -1,7 +1,11 @@
 #pragma once
 
+#include <string>
+
 #include <nix/common-args.hh>
 
+#include <remote-build-queue/scheduler.hh>
+
 namespace remote_build {
 namespace queue {
 
@@ -16,7 +20,127 @@ namespace queue {
 #pragma clang diagnostic ignored "-Wmissing-field-initializers"
 #endif
 struct Args : nix::MixCommonArgs {
-  Args() : nix::MixCommonArgs("remote-build-queue") {}
+  std::string scheduler = scheduler::default_policy;
+  unsigned int valid_path_ttl = 3600;
+  unsigned int nar_cache_size = 512;
+  std::string nar_cache_compression = "none";
+  unsigned int max_transfers = 8;
+  unsigned int max_machine_transfers = 4;
+  bool compress_transfers = false;
+  unsigned int max_db_connections = 4;
+  unsigned int db_timeout = 60;
+  std::string name = "";
+  unsigned int claim_lease = 60;
+  unsigned int claim_batch = 64;
+  unsigned int recover_within = 24;
+
+  Args() : nix::MixCommonArgs("remote-build-queue") {
+    addFlag({
+        .longName = "scheduler",
+        .description = "How to rank the idle machines able to build a job. "
+                       "One of 'load' (default), 'locality' or 'speed'.",
+        .labels = {"policy"},
+        .handler = {&scheduler},
+    });
+
+    addFlag({
+        .longName = "valid-path-ttl",
+        .description = "Seconds to assume a path copied to a machine stays "
+                       "valid there before asking the machine again. "
+                       "0 always asks.",
+        .labels = {"seconds"},
+        .handler = {&valid_path_ttl},
+    });
+
+    addFlag({
+        .longName = "nar-cache-size",
+        .description = "MiB of recently sent NARs to keep for sending to "
+                       "other machines. 0 disables the cache.",
+        .labels = {"mib"},
+        .handler = {&nar_cache_size},
+    });
+
+    addFlag({
+        .longName = "nar-cache-compression",
+        .description = "How to compress cached NARs, e.g. 'zstd' or 'xz'. "
+                       "Defaults to 'none'.",
+        .labels = {"method"},
+        .handler = {&nar_cache_compression},
+    });
+
+    addFlag({
+        .longName = "max-transfers",
+        .description = "How many inputs to upload to machines at once.",
+        .labels = {"n"},
+        .handler = {&max_transfers},
+    });
+
+    addFlag({
+        .longName = "max-transfers-per-machine",
+        .description = "How many inputs to upload to any one machine at once.",
+        .labels = {"n"},
+        .handler = {&max_machine_transfers},
+    });
+
+    addFlag({
+        .longName = "compress-transfers",
+        .description = "Compress the ssh streams to machines. Pays off on "
+                       "slow links.",
+        .handler = {&compress_transfers, true},
+    });
+
+    addFlag({
+        .longName = "max-db-connections",
+        .description = "How many postgres connections to open at most, "
+                       "including the one listening for events.",
+        .labels = {"n"},
+        .handler = {&max_db_connections},
+    });
+
+    addFlag({
+        .longName = "db-timeout",
+        .description = "Seconds the connection listening for events may "
+                       "stay quiet before it is pinged, and the ping "
+                       "unanswered before giving up.",
+        .labels = {"seconds"},
+        .handler = {&db_timeout},
+    });
+
+    addFlag({
+        .longName = "name",
+        .description = "Name this daemon claims jobs under, unique among "
+                       "those sharing the database. Defaults to the host "
+                       "name.",
+        .labels = {"name"},
+        .handler = {&name},
+    });
+
+    addFlag({
+        .longName = "claim-lease",
+        .description = "Seconds a claim on a job lasts unless renewed, and "
+                       "so how long the jobs of a dead daemon wait to be "
+                       "taken over.",
+        .labels = {"seconds"},
+        .handler = {&claim_lease},
+    });
+
+    addFlag({
+        .longName = "claim-batch",
+        .description = "How many jobs to hold at most while every capable "
+                       "machine is busy.",
+        .labels = {"n"},
+        .handler = {&claim_batch},
+    });
+
+    addFlag({
+        .longName = "recover-within",
+        .description = "Hours since a job started, after which it is no "
+                       "longer picked up nor taken over from a dead "
+                       "daemon, e.g. when all were down for a while.",
+        .labels = {"hours"},
+        .handler = {&recover_within},
+    });
+  }
 
   ~Args() {}
 };
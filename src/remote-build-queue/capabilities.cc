@@ -0,0 +1,173 @@
+#include <algorithm>
+
+#include <nix/util.hh>
+
+#include <remote-build-queue/capabilities.hh>
+
+namespace remote_build {
+namespace queue {
+namespace capabilities {
+
+Features Interner::intern(set<string> const &features) {
+  Features res;
+
+  for (auto &feature : features) {
+    auto bit = this->bits.find(feature);
+
+    if (bit == this->bits.end()) {
+      if (this->bits.size() == MAX_FEATURES)
+        throw nix::Error("machines mention more than %d distinct features",
+                         MAX_FEATURES);
+
+      bit = this->bits.emplace(feature, this->bits.size()).first;
+    }
+
+    res.set(bit->second);
+  }
+
+  return res;
+}
+
+optional<Features> Interner::lookup(set<string> const &features) const {
+  Features res;
+
+  for (auto &feature : features) {
+    auto bit = this->bits.find(feature);
+
+    if (bit == this->bits.end())
+      return std::nullopt;
+
+    res.set(bit->second);
+  }
+
+  return res;
+}
+
+bool Capability::satisfies(string const &system,
+                           Features const &required) const {
+  return (system == "builtin" ||
+          std::binary_search(systems.begin(), systems.end(), system)) &&
+         (required & ~supported).none() && (mandatory & ~required).none();
+}
+
+size_t Index::add(nix::Machine const &machine, size_t machine_id) {
+  auto mandatory = this->interner.intern(machine.mandatoryFeatures);
+
+  // Like nix::Machine::allSupported, mandatory features count as supported
+  auto cap = Capability{
+      .systems = machine.systemTypes,
+      .supported = this->interner.intern(machine.supportedFeatures) | mandatory,
+      .mandatory = mandatory,
+  };
+
+  std::sort(cap.systems.begin(), cap.systems.end());
+
+  auto cls = std::find_if(classes.begin(), classes.end(),
+                          [&cap](Class const &c) { return c.cap == cap; });
+
+  if (cls == classes.end()) {
+    classes.push_back(Class{.cap = cap, .idle = {}});
+
+    // A new class may match keys that were memoized without it
+    matches.clear();
+
+    cls = std::prev(classes.end());
+  }
+
+  auto slot = slot_class.size();
+
+  slot_class.push_back(cls - classes.begin());
+
+  slot_machine.push_back(machine_id);
+
+  cls->idle[machine_id].insert(slot);
+
+  return slot;
+}
+
+vector<size_t> const *Index::capable(job::Job const &job) {
+  auto required = this->interner.lookup(job.system_features);
+
+  if (!required)
+    return nullptr;
+
+  auto key = Key{.system = job.system, .required = *required};
+
+  auto found = this->matches.find(key);
+
+  if (found != this->matches.end())
+    return &found->second;
+
+  vector<size_t> res;
+
+  for (size_t i = 0; i < this->classes.size(); i++)
+    if (this->classes[i].cap.satisfies(job.system, *required))
+      res.push_back(i);
+
+  return &this->matches.emplace(key, res).first->second;
+}
+
+bool Index::can_build(job::Job const &job) {
+  auto cls = this->capable(job);
+
+  return cls && !cls->empty();
+}
+
+bool Index::can_build(size_t slot, job::Job const &job) {
+  auto cls = this->capable(job);
+
+  return cls && std::find(cls->begin(), cls->end(), this->slot_class[slot]) !=
+                    cls->end();
+}
+
+vector<Idle> Index::candidates(job::Job const &job) {
+  vector<Idle> res;
+
+  auto cls = this->capable(job);
+
+  if (!cls)
+    return res;
+
+  // Already known to succeed through capable
+  auto required = *this->interner.lookup(job.system_features);
+
+  for (auto i : *cls) {
+    auto unused = (this->classes[i].cap.supported & ~required).count();
+
+    for (auto &[machine, idle] : this->classes[i].idle)
+      res.push_back(Idle{.slot = *idle.begin(), .unused_features = unused});
+  }
+
+  return res;
+}
+
+void Index::take(size_t slot) {
+  auto &idle = this->classes[this->slot_class[slot]].idle;
+
+  auto machine = idle.find(this->slot_machine[slot]);
+
+  machine->second.erase(slot);
+
+  if (machine->second.empty())
+    idle.erase(machine);
+}
+
+void Index::set_idle(size_t slot) {
+  this->classes[this->slot_class[slot]]
+      .idle[this->slot_machine[slot]]
+      .insert(slot);
+}
+
+size_t Index::idle_slots() const {
+  size_t n = 0;
+
+  for (auto &cls : this->classes)
+    for (auto &[machine, idle] : cls.idle)
+      n += idle.size();
+
+  return n;
+}
+
+} // namespace capabilities
+} // namespace queue
+} // namespace remote_build
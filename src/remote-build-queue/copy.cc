@@ -0,0 +1,63 @@
+#include <memory>
+
+#include <nix/compression.hh>
+#include <nix/logging.hh>
+#include <nix/serialise.hh>
+
+#include <remote-build-queue/copy.hh>
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+using nix::fmt;
+using nix::logger;
+using nix::Verbosity::lvlVomit;
+
+namespace remote_build {
+namespace queue {
+namespace copy {
+
+void send_path(nix::Store &local, nix::Store &remote,
+               nix::StorePath const &path, Sync<nar_cache::NarCache> &cache) {
+  auto info = local.queryPathInfo(path);
+
+  auto key = info->narHash.to_string(nix::Base32, true);
+
+  auto compression = cache.lock()->compression;
+
+  if (!cache.lock()->admits(info->narSize))
+    return nix::copyStorePath(local, remote, path, nix::NoRepair,
+                              nix::NoCheckSigs);
+
+  auto stored = cache.lock()->lookup(key);
+
+  shared_ptr<const string> nar;
+
+  if (stored) {
+    vomit("sending '%s' from the NAR cache", local.printStorePath(path));
+
+    nar = compression == "none" ? stored
+                                : make_shared<const string>(
+                                      nix::decompress(compression, *stored));
+
+  } else {
+    nix::StringSink sink;
+
+    local.narFromPath(path, sink);
+
+    nar = make_shared<const string>(std::move(sink.s));
+
+    cache.lock()->insert(key, compression == "none"
+                                  ? nar
+                                  : nix::compress(compression, *nar).get_ptr());
+  }
+
+  nix::StringSource source(*nar);
+
+  remote.addToStore(*info, source, nix::NoRepair, nix::NoCheckSigs);
+}
+
+} // namespace copy
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,60 @@
+#include <nix/derivations.hh>
+#include <nix/util.hh>
+
+#include <remote-build-queue/locality.hh>
+
+namespace remote_build {
+namespace queue {
+namespace locality {
+
+Closure input_closure(nix::Store &local, nix::StorePath const &drv_path) {
+  auto drv = local.readDerivation(drv_path);
+
+  nix::StorePathSet inputs(drv.inputSrcs);
+
+  for (auto &[input_drv, wanted] : drv.inputDrvs) {
+    auto outputs = local.queryPartialDerivationOutputMap(input_drv);
+
+    for (auto &name : wanted) {
+      auto output = nix::get(outputs, name);
+
+      if (output && *output && local.isValidPath(**output))
+        inputs.insert(**output);
+    }
+  }
+
+  nix::StorePathSet paths;
+
+  local.computeFSClosure(inputs, paths);
+
+  Closure closure;
+
+  for (auto &path : paths)
+    closure.emplace(path, local.queryPathInfo(path)->narSize);
+
+  return closure;
+}
+
+uint64_t total_bytes(Closure const &closure) {
+  uint64_t total = 0;
+
+  for (auto &[path, size] : closure)
+    total += size;
+
+  return total;
+}
+
+uint64_t missing_bytes(Closure const &closure,
+                       valid_paths::ValidPaths const &valid) {
+  uint64_t missing = 0;
+
+  for (auto &[path, size] : closure)
+    if (!valid.contains(path))
+      missing += size;
+
+  return missing;
+}
+
+} // namespace locality
+} // namespace queue
+} // namespace remote_build
@@ -13,15 +13,21 @@ namespace queue {
 namespace machines {
 
 nix::ref<nix::Store> open_store(nix::Machine const &machine,
-                                nix::Pipe &ssh_pipe) {
+                                nix::Pipe &ssh_pipe,
+                                StoreSettings const &settings) {
   nix::Store::Params storeParams;
   if (nix::hasPrefix(machine.storeUri, "ssh://")) {
-    storeParams["max-connections"] = "1";
     storeParams["log-fd"] = nix::fmt("%d", ssh_pipe.writeSide.get());
   }
 
   if (nix::hasPrefix(machine.storeUri, "ssh://") ||
       nix::hasPrefix(machine.storeUri, "ssh-ng://")) {
+    // Every build slot and upload to the machine shares this store
+    storeParams["max-connections"] =
+        nix::fmt("%d", std::max(settings.max_connections, 1u));
+
+    if (settings.compress)
+      storeParams["compress"] = "true";
     if (machine.sshKey != "")
       storeParams["ssh-key"] = machine.sshKey;
     if (machine.sshPublicHostKey != "")
@@ -38,36 +44,6 @@ nix::ref<nix::Store> open_store(nix::Machine const &machine,
   return nix::openStore(machine.storeUri, storeParams);
 }
 
-/// Relies on systems being sorted/unique on load,
-bool priority_lt(const shared_ptr<nix::Machine> &a,
-                 const shared_ptr<nix::Machine> &b) {
-  if (a->systemTypes < b->systemTypes)
-    return false;
-
-  if (b->mandatoryMet(a->mandatoryFeatures))
-    return false;
-
-  if (a->allSupported(b->supportedFeatures))
-    return false;
-
-  if (a->speedFactor < b->speedFactor)
-    return false;
-
-  if (a->maxJobs < b->maxJobs)
-    return false;
-
-  if (a->storeUri < b->storeUri)
-    return false;
-
-  if (a->sshPublicHostKey < b->sshPublicHostKey)
-    return false;
-
-  if (a->sshKey < b->sshKey)
-    return false;
-
-  return true;
-}
-
 nix::Machine sort_unique_system_types(const nix::Machine &m) {
   vector<std::string> system_types(m.systemTypes);
 
@@ -98,14 +74,6 @@ std::string show(nix::Machine const &machine) {
   return concat_strings::sep(strings, " ");
 }
 
-bool can_build(nix::Machine const &machine, job::Job const &todo) {
-  return (todo.system == "builtin" ||
-          std::find(machine.systemTypes.begin(), machine.systemTypes.end(),
-                    todo.system) != machine.systemTypes.end()) &&
-         machine.allSupported(todo.system_features) &&
-         machine.mandatoryMet(todo.system_features);
-}
-
 } // namespace machines
 } // namespace queue
 } // namespace remote_build
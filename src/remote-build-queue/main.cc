@@ -25,7 +25,8 @@ using nlohmann::json;
 namespace remote_build {
 namespace queue {
 
-void main(postgres::ConnectionParams const &conn_params) {
+void main(postgres::ConnectionParams const &conn_params,
+          Options const &options) {
   assert(PQisthreadsafe());
 
   // Avoid asking for ssh creds on stdin when using ssh store connections
@@ -33,20 +34,39 @@ void main(postgres::ConnectionParams const &conn_params) {
 
   unsetenv("SSH_ASKPASS");
 
-  nix::ref<State> state(std::make_unique<State>(conn_params));
+  nix::ref<State> state(std::make_unique<State>(conn_params, options));
 
-  debug("machine priorities:");
+  debug("machines:");
 
-  for (auto &slot : state->ready)
-    debug(machines::show(*slot->machine.get()));
+  for (auto &builder : state->builders)
+    debug(machines::show(*builder->machine.get()));
 
-  auto events_buf = Buffer<ListenResult *>{};
+  auto events_buf = Buffer<Notified>{};
 
   thread([&state, &events_buf]() {
     collect_events(state, events_buf);
   }).detach();
 
-  thread([&state, &events_buf]() { listen_queue(state, events_buf); }).detach();
+  listen_queue(state, events_buf);
+
+  thread([&state]() { state->reactor.run(); }).detach();
+
+  {
+    // A restart need not wait for the claims of the last run to lapse
+    auto conn_res = state->db.get();
+
+    if (std::holds_alternative<string>(conn_res))
+      throw nix::Error(get<string>(conn_res));
+
+    auto release_res =
+        release_claims(get<shared_ptr<PGconn>>(conn_res).get(), state->name);
+
+    if (std::holds_alternative<string>(release_res))
+      throw nix::Error(get<string>(release_res));
+  }
+
+  // Takes the jobs started before we listened, and those of dead daemons
+  thread([&state]() { keep_claims(state); }).detach();
 
   auto wake_workers = worker::Wakeup();
 
@@ -62,13 +82,27 @@ void main(postgres::ConnectionParams const &conn_params) {
     state->fatal.notify_one();
   }).detach();
 
+  for (unsigned int i = 0; i < state->transfers.max_streams; i++)
+    thread([&state]() { state->transfers.run(); }).detach();
+
   for (auto &worker : state->ready) {
-    thread([&worker, &wake_workers]() { worker->run(wake_workers); }).detach();
+    thread([&state, &worker, &wake_workers]() {
+      // Jobs fail on their own, this is only whatever is left
+      try {
+        worker->run(wake_workers, state->waiting, state->index,
+                    state->transfers, state->routes,
+                    [&state]() { want_claim(state); });
+
+      } catch (std::exception &e) {
+        worker->die(wake_workers, nix::Error(e.what()));
+      }
+    }).detach();
   }
 
   auto exc(state->exc_.lock());
 
-  exc.wait(state->fatal);
+  while (!*exc)
+    exc.wait(state->fatal);
 
   debug("shutting down");
 
@@ -80,47 +114,194 @@ void main(postgres::ConnectionParams const &conn_params) {
   }
 }
 
-void listen_queue(nix::ref<State> &state, Buffer<ListenResult *> &buf) {
-  auto listen_res = dequeue::listen_channel(state->conn_params, "events");
+void listen_queue(nix::ref<State> &state, Buffer<Notified> &buf) {
+  auto listen_res = dequeue::listen_channel(state->db, "events");
 
   if (std::holds_alternative<string>(listen_res))
     return quit(state, nix::Error(get<string>(listen_res)));
 
   auto events = get<Events>(listen_res);
 
-  auto events_iter = events.begin();
+  auto watch_err = state->reactor.watch(
+      events.conn, state->db_timeout,
+      [&buf](vector<shared_ptr<PGnotify>> const &notifications) {
+        auto results = dequeue::parse_notifications(notifications, "events");
 
+        for (; !results.empty(); results.pop())
+          buf.push(results.front());
+      },
+      [&buf](string const &msg) {
+        buf.push(Notified(dequeue::Error(dequeue::ConnectionLost(msg))));
+      });
+
+  if (watch_err)
+    return quit(state, nix::Error(*watch_err));
+}
+
+void collect_events(nix::ref<State> &state, Buffer<Notified> &buf) {
   while (true) {
-    buf.push(events_iter->curr.get());
+    std::queue<Notified> batch;
+
+    batch.push(buf.pop());
+
+    // Whatever else arrived meanwhile is fetched in the same query
+    while (batch.size() < 256 && buf.try_front())
+      batch.push(buf.pop());
+
+    std::queue<Notified> others;
+
+    bool started = false;
+
+    bool lost = false;
+
+    for (; !batch.empty(); batch.pop()) {
+      auto &notified = batch.front();
+
+      if (std::holds_alternative<event::Fields<json>>(notified) &&
+          get<event::Fields<json>>(notified).name == "start")
+        started = true;
+
+      else if (std::holds_alternative<dequeue::Error>(notified) &&
+               std::holds_alternative<dequeue::ConnectionLost>(
+                   get<dequeue::Error>(notified))) {
+        printError(dequeue::err_msg(get<dequeue::Error>(notified)));
+
+        lost = true;
 
-    ++events_iter;
+      } else
+        others.push(notified);
+    }
+
+    auto conn_res = state->db.get();
+
+    if (std::holds_alternative<string>(conn_res))
+      return quit(state, nix::Error(get<string>(conn_res)));
+
+    auto conn = get<shared_ptr<PGconn>>(conn_res);
+
+    // Start events are left to claim, so none are denied here
+    vector<Uuid> denied;
+
+    auto handle_result = overloaded{
+        [&state, &conn, &denied](Event const &event) {
+          handle_event(state, conn.get(), event, denied);
+        },
+        [&state, &conn](dequeue::Error const &err) {
+          handle_err(state, conn.get(), err);
+        },
+    };
+
+    auto results = dequeue::hydrate(conn.get(), others);
+
+    for (; !results.empty(); results.pop())
+      visit(handle_result, results.front());
+
+    if (lost)
+      catch_up(state, conn.get(), buf);
+
+    // On the claiming thread, as dispatching reads the jobs' closures
+    if (started || lost)
+      want_claim(state);
   }
 }
 
-void collect_events(nix::ref<State> &state, Buffer<ListenResult *> &buf) {
-  auto conn_res = postgres::connect(state->conn_params);
+void catch_up(nix::ref<State> &state, PGconn *conn, Buffer<Notified> &buf) {
+  listen_queue(state, buf);
 
-  if (std::holds_alternative<string>(conn_res))
-    return quit(state, nix::Error(get<string>(conn_res)));
+  // Only after listening again, so that nothing falls in between. Those
+  // heard both ways are dropped by routes.
+  auto missed = dequeue::get_missed_events(conn, state->routes.cursors());
 
-  auto conn = get<shared_ptr<PGconn>>(conn_res);
+  if (std::holds_alternative<string>(missed))
+    return quit(state, nix::Error(get<string>(missed)));
 
-  auto handle_result = overloaded{
-      [&state, &conn](Event const &event) {
-        handle_event(state, conn.get(), event);
-      },
-      [&state, &conn](dequeue::Error const &err) {
-        handle_err(state, conn.get(), err);
-      },
-  };
+  for (auto &queued = get<std::queue<ListenResult>>(missed); !queued.empty();
+       queued.pop())
+    if (std::holds_alternative<Event>(queued.front()))
+      state->routes.deliver(get<Event>(queued.front()));
+}
+
+void claim(nix::ref<State> &state, PGconn *conn) {
+  std::unique_lock claiming(state->claiming);
+
+  auto waiting = state->waiting.lock()->size();
+
+  // Whatever is claimed goes to an idle slot or else waits
+  auto room = state->index.lock()->idle_slots() +
+              (waiting < state->claim_batch ? state->claim_batch - waiting : 0);
+
+  if (room == 0)
+    return;
+
+  auto claim_res = claim_jobs(conn, state->name, state->claim_lease, room,
+                              state->recover_within);
+
+  if (std::holds_alternative<string>(claim_res))
+    return quit(state, nix::Error(get<string>(claim_res)));
+
+  vector<Uuid> denied;
+
+  for (auto &claimed : get<vector<Claimed>>(claim_res)) {
+    if (claimed.resumed) {
+      debug("taking over job %s", claimed.start.job.to_string());
+
+      state->routes.resume(claimed.start.job);
+    }
+
+    handle_event(state, conn, claimed.start, denied);
+  }
+
+  if (denied.empty())
+    return;
+
+  auto pass_res = pass_jobs(conn, state->name, denied);
+
+  if (std::holds_alternative<string>(pass_res))
+    return quit(state, nix::Error(get<string>(pass_res)));
+}
+
+void want_claim(nix::ref<State> &state) {
+  *state->claim_wanted.lock() = true;
+
+  state->claim_wakeup.notify_one();
+}
+
+void keep_claims(nix::ref<State> &state) {
+  auto renew_at = std::chrono::steady_clock::now();
 
   while (true) {
-    visit(handle_result, *buf.pop());
+    auto conn_res = state->db.get();
+
+    if (std::holds_alternative<string>(conn_res))
+      return quit(state, nix::Error(get<string>(conn_res)));
+
+    auto conn = get<shared_ptr<PGconn>>(conn_res);
+
+    if (std::chrono::steady_clock::now() >= renew_at) {
+      auto renew_res =
+          renew_claims(conn.get(), state->name, state->claim_lease);
+
+      if (std::holds_alternative<string>(renew_res))
+        return quit(state, nix::Error(get<string>(renew_res)));
+
+      renew_at = std::chrono::steady_clock::now() + state->claim_lease / 3;
+    }
+
+    claim(state, conn.get());
+
+    conn.reset();
+
+    auto wanted(state->claim_wanted.lock());
+
+    while (!*wanted && std::chrono::steady_clock::now() < renew_at)
+      wanted.wait_until(state->claim_wakeup, renew_at);
+
+    *wanted = false;
   }
 }
 
 void handle_event(nix::ref<State> &state, PGconn *conn,
-                  event::Event const &event) {
+                  event::Event const &event, vector<Uuid> &denied) {
   auto handler = overloaded{
       [&](event::Start const &start) {
         auto job_res = job::get(conn, start.job);
@@ -131,38 +312,83 @@ void handle_event(nix::ref<State> &state, PGconn *conn,
           return;
         }
 
-        auto slot = std::find_if(state->ready.begin(), state->ready.end(),
-                                 [&](shared_ptr<Worker> const &worker) {
-                                   auto worker_curr(worker->todo.lock());
+        if (!state->index.lock()->can_build(start.payload)) {
+          vomit("passing on job %s, no machine here can build it",
+                start.job.to_string());
 
-                                   return !*worker_curr &&
-                                          machines::can_build(*worker->machine,
-                                                              start.payload);
-                                 });
+          denied.push_back(start.job);
 
-        if (slot == state->ready.end()) {
-          vomit("rejecting job %s, no machine available", start.job.val);
+          return;
+        }
+
+        // Read once, to rank the machines and for the slot to prefetch
+        auto closure = std::make_shared<locality::Closure>();
+
+        try {
+          *closure = locality::input_closure(*state->local_store,
+                                             nix::StorePath(start.payload.drv));
+
+        } catch (nix::Error &e) {
+          debug("not considering the inputs of %s: %s", start.job.to_string(),
+                e.what());
+        }
+
+        auto closure_bytes = locality::total_bytes(*closure);
+
+        auto todo = wait_queue::Todo{.start = start, .closure = closure};
+
+        // Hold the wait queue while looking for an idle worker so that a
+        // worker finishing concurrently cannot miss a job parked here.
+        auto waiting(state->waiting.lock());
+
+        auto idx(state->index.lock());
+
+        vector<scheduler::Candidate> candidates;
 
-          auto deny_res = no_machine_available(conn, start.job);
+        for (auto &idle : idx->candidates(start.payload)) {
+          auto &builder = state->ready[idle.slot]->builder;
 
-          if (std::holds_alternative<string>(deny_res))
-            return quit(state, nix::Error(get<string>(deny_res)));
+          auto missing = closure_bytes == 0
+                             ? 0
+                             : locality::missing_bytes(
+                                   *closure, *builder->valid_paths.lock());
+
+          candidates.push_back(scheduler::Candidate{
+              .slot = idle.slot,
+              .machine = builder->machine.get(),
+              .free_slots = std::max(builder->free_slots(), 1u),
+              .unused_features = idle.unused_features,
+              .mean_build_secs = *builder->mean_build_secs.lock(),
+              .relative_duration = 1,
+              .missing_fraction =
+                  closure_bytes == 0 ? 0 : double(missing) / closure_bytes,
+          });
+        }
+
+        auto slot = scheduler::pick(state->score, candidates, start.payload);
+
+        if (!slot) {
+          vomit("parking job %s, every capable machine is busy",
+                start.job.to_string());
+
+          waiting->push(todo);
 
         } else {
-          auto worker = *slot;
+          idx->take(*slot);
 
-          auto worker_job(worker->todo.lock());
+          auto worker = state->ready[*slot];
 
-          *worker_job = std::make_unique<event::Start>(start);
+          auto worker_job(worker->todo.lock());
 
-          worker->inbox.notify_one();
+          worker->assign(worker_job, todo);
         }
       },
-      [](event::Cancel const &e) {},
-      [](event::Accept const &e) {},
-      [](event::NoMachineAvailable const &e) {},
-      [](event::AddInputsAndOutputs const &e) {},
-      [](event::Fail const &e) {},
+      [&](event::Cancel const &e) { state->routes.deliver(e); },
+      [&](event::Accept const &e) { state->routes.deliver(e); },
+      [&](event::NoMachineAvailable const &e) { state->routes.deliver(e); },
+      [&](event::AddInputsAndOutputs const &e) { state->routes.deliver(e); },
+      [&](event::Fail const &e) { state->routes.deliver(e); },
+      [&](event::Succeed const &e) { state->routes.deliver(e); },
   };
 
   visit(handler, event);
@@ -179,6 +405,10 @@ void handle_err(nix::ref<State> &state, PGconn *conn,
   if (std::holds_alternative<dequeue::ConsumingInput>(err)) {
     return quit(state, err);
   }
+
+  if (std::holds_alternative<dequeue::ConnectionLost>(err)) {
+    return quit(state, err);
+  }
 }
 
 void quit(nix::ref<State> &state, nix::Error const &e) {
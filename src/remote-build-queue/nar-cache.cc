@@ -0,0 +1,43 @@
+#include <remote-build-queue/nar-cache.hh>
+
+namespace remote_build {
+namespace queue {
+namespace nar_cache {
+
+shared_ptr<const string> NarCache::lookup(string const &nar_hash) {
+  auto found = this->entries.find(nar_hash);
+
+  if (found == this->entries.end())
+    return nullptr;
+
+  this->lru.splice(this->lru.begin(), this->lru, found->second.used);
+
+  return found->second.data;
+}
+
+void NarCache::insert(string const &nar_hash, shared_ptr<const string> data) {
+  if (data->size() > this->max_bytes ||
+      this->entries.find(nar_hash) != this->entries.end())
+    return;
+
+  while (!this->lru.empty() && this->bytes + data->size() > this->max_bytes) {
+    auto oldest = this->entries.find(this->lru.back());
+
+    this->bytes -= oldest->second.data->size();
+
+    this->entries.erase(oldest);
+
+    this->lru.pop_back();
+  }
+
+  this->lru.push_front(nar_hash);
+
+  this->entries.emplace(nar_hash,
+                        Entry{.data = data, .used = this->lru.begin()});
+
+  this->bytes += data->size();
+}
+
+} // namespace nar_cache
+} // namespace queue
+} // namespace remote_build
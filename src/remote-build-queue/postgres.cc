@@ -1,3 +1,4 @@
+#include <chrono>
 #include <sstream>
 #include <variant>
 
@@ -6,6 +7,8 @@
 using std::get;
 using std::variant;
 
+using nix::fmt;
+
 namespace remote_build {
 namespace queue {
 
@@ -57,39 +60,164 @@ env_conn_params(map<string, string> const &env) {
   };
 }
 
-variant<string, monostate> no_machine_available(PGconn *conn, Uuid const &job) {
-  auto escaped = postgres::escape_uuid(job);
+static postgres::Prepared const select_claim_jobs{
+    .name = "claim_jobs",
+    .stmt = "SELECT * FROM ROWS FROM (@schema@.claim_jobs("
+            "$1, $2::interval, $3, $4::interval))",
+};
+
+static postgres::Prepared const select_release_claims{
+    .name = "release_claims",
+    .stmt = "SELECT @schema@.release_claims($1)",
+};
+
+static postgres::Prepared const select_succeed_job{
+    .name = "succeed_job",
+    .stmt = "SELECT @schema@.succeed_job($1)",
+};
+
+static postgres::Prepared const select_fail_job{
+    .name = "fail_job",
+    .stmt = "SELECT @schema@.fail_job($1, $2)",
+};
+
+static postgres::Prepared const select_pass_jobs{
+    .name = "pass_jobs",
+    .stmt = "SELECT @schema@.pass_jobs($1, $2)",
+};
+
+static postgres::Prepared const select_renew_claims{
+    .name = "renew_claims",
+    .stmt = "SELECT @schema@.renew_claims($1, $2::interval)",
+};
+
+static postgres::Param interval_param(std::chrono::seconds d) {
+  return postgres::text_param(fmt("%d seconds", d.count()));
+}
+
+static postgres::Prepared const select_accept_job{
+    .name = "accept_job",
+    .stmt = "SELECT @schema@.accept_job($1, $2::@schema@.textword)",
+};
+
+/// Reads a row of claim_jobs: a row of get_events, then resumed.
+static postgres::FromRowResult<Claimed>
+claimed_from_row(std::array<optional<string>, 6> tup) {
+  auto start = event::from_row({tup[0], tup[1], tup[2], tup[3], tup[4]});
+
+  if (std::holds_alternative<postgres::FromRowError>(start))
+    return get<postgres::FromRowError>(start);
+
+  if (!std::holds_alternative<event::Start>(get<event::Event>(start)))
+    return postgres::FromRowError("claimed something other than a start");
+
+  if (!tup[5].has_value() || tup[5]->size() != 1)
+    return postgres::FromRowError("resumed was not a boolean");
+
+  return Claimed{
+      .start = get<event::Start>(get<event::Event>(start)),
+      .resumed = (*tup[5])[0] != 0,
+  };
+}
+
+variant<string, vector<Claimed>> claim_jobs(PGconn *conn, string const &daemon,
+                                            std::chrono::seconds lease,
+                                            size_t n,
+                                            std::chrono::seconds horizon) {
+  auto res = postgres::exec_prepared(conn, select_claim_jobs,
+                                     {
+                                         postgres::text_param(daemon),
+                                         interval_param(lease),
+                                         postgres::int4_param(int32_t(n)),
+                                         interval_param(horizon),
+                                     });
+
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    return postgres::err_msg(res.get(), "claiming jobs");
+
+  vector<Claimed> claimed;
+
+  for (auto &row : postgres::collect_tuples<Claimed, 6>(res.get(),
+                                                        claimed_from_row)) {
+    if (std::holds_alternative<postgres::FromRowError>(row))
+      return "claiming jobs: " + get<postgres::FromRowError>(row).msg;
+
+    claimed.push_back(get<Claimed>(row));
+  }
+
+  return claimed;
+}
+
+variant<string, monostate> release_claims(PGconn *conn, string const &daemon) {
+  auto res = postgres::exec_prepared(conn, select_release_claims,
+                                     {postgres::text_param(daemon)});
+
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    return variant<string, monostate>(
+        postgres::err_msg(res.get(), "releasing claims"));
 
-  char *params[1] = {escaped.data()};
+  return variant<string, monostate>(monostate());
+}
 
-  auto res = postgres::exec_params(
-      conn,
-      "INSERT INTO @schema@.events (name, job) "
-      "VALUES ('no-machine-available'::@schema@.event, $1::uuid)",
-      1, params);
+variant<string, monostate> pass_jobs(PGconn *conn, string const &daemon,
+                                     vector<Uuid> const &jobs) {
+  auto res = postgres::exec_prepared(
+      conn, select_pass_jobs,
+      {postgres::text_param(daemon), postgres::uuid_array_param(jobs)});
 
-  if (PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
     return variant<string, monostate>(postgres::err_msg(
-        res.get(), "inserting 'no-machine-available' " + job.val));
+        res.get(), fmt("passing on %d jobs", jobs.size())));
+
+  return variant<string, monostate>(monostate());
+}
+
+variant<string, monostate> renew_claims(PGconn *conn, string const &daemon,
+                                        std::chrono::seconds lease) {
+  auto res = postgres::exec_prepared(
+      conn, select_renew_claims,
+      {postgres::text_param(daemon), interval_param(lease)});
+
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    return variant<string, monostate>(
+        postgres::err_msg(res.get(), "renewing claims"));
 
   return variant<string, monostate>(monostate());
 }
 
 variant<string, monostate> accept_job(PGconn *conn, Uuid const &job,
                                       string const &store_uri) {
-  auto escaped_id = postgres::escape_uuid(job);
+  auto res = postgres::exec_prepared(
+      conn, select_accept_job,
+      {postgres::uuid_param(job), postgres::text_param(store_uri)});
 
-  auto uri = string(store_uri);
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    return variant<string, monostate>(
+        postgres::err_msg(res.get(), "accepting job " + job.to_string()));
+
+  return variant<string, monostate>(monostate());
+}
+
+variant<string, monostate> succeed_job(PGconn *conn, Uuid const &job) {
+  auto res = postgres::exec_prepared(conn, select_succeed_job,
+                                     {postgres::uuid_param(job)});
 
-  char *params[2] = {escaped_id.data(), uri.data()};
+  if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    return variant<string, monostate>(
+        postgres::err_msg(res.get(), "succeeding job " + job.to_string()));
+
+  return variant<string, monostate>(monostate());
+}
 
-  auto res = postgres::exec_params(
-      conn, "SELECT @schema@.accept_job($1::uuid, $2::@schema@.textword)", 2,
-      params);
+variant<string, monostate> fail_job(PGconn *conn, Uuid const &job,
+                                    string const &msg) {
+  auto res = postgres::exec_prepared(
+      conn, select_fail_job,
+      {postgres::uuid_param(job), postgres::text_param(msg)});
 
   if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
     return variant<string, monostate>(
-        postgres::err_msg(res.get(), "accepting job " + job.val));
+        postgres::err_msg(res.get(), "failing job " + job.to_string()));
 
   return variant<string, monostate>(monostate());
 }
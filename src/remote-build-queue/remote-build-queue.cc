@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <chrono>
 #include <variant>
 
+#include <unistd.h>
+
+#include <nix/compression.hh>
 #include <nix/config.hh>
 #include <nix/globals.hh>
 #include <nix/shared.hh>
@@ -16,6 +21,15 @@ using nix::Verbosity::lvlVomit;
 
 inline remote_build::queue::Args args;
 
+static std::string host_name() {
+  char buf[256] = {};
+
+  if (gethostname(buf, sizeof(buf) - 1) != 0)
+    throw nix::SysError("getting the host name");
+
+  return buf;
+}
+
 int main(int argc, char **argv) {
   return nix::handleExceptions(argv[0], [&]() {
     nix::initNix();
@@ -29,8 +43,38 @@ int main(int argc, char **argv) {
     if (std::holds_alternative<string>(conn_params))
       throw nix::UsageError(get<string>(conn_params));
 
+    auto score = remote_build::queue::scheduler::policy(args.scheduler);
+
+    if (!score)
+      throw nix::UsageError("unknown scheduler '%s'", args.scheduler);
+
+    // Fail now rather than in the transfer threads on every upload
+    try {
+      nix::decompress(args.nar_cache_compression,
+                      *nix::compress(args.nar_cache_compression, ""));
+    } catch (nix::Error &) {
+      throw nix::UsageError("unknown NAR cache compression '%s'",
+                            args.nar_cache_compression);
+    }
+
+    auto options = remote_build::queue::Options{
+        .score = *score,
+        .valid_path_ttl = std::chrono::seconds(args.valid_path_ttl),
+        .nar_cache_bytes = size_t(args.nar_cache_size) << 20,
+        .nar_cache_compression = args.nar_cache_compression,
+        .max_transfers = std::max(args.max_transfers, 1u),
+        .max_machine_transfers = std::max(args.max_machine_transfers, 1u),
+        .compress_transfers = args.compress_transfers,
+        .max_db_connections = std::max(args.max_db_connections, 2u),
+        .db_timeout = std::chrono::seconds(std::max(args.db_timeout, 1u)),
+        .name = args.name.empty() ? host_name() : args.name,
+        .claim_lease = std::chrono::seconds(std::max(args.claim_lease, 3u)),
+        .claim_batch = std::max(args.claim_batch, 1u),
+        .recover_within = std::chrono::hours(args.recover_within),
+    };
+
     remote_build::queue::main(
-        get<remote_build::postgres::ConnectionParams>(conn_params));
+        get<remote_build::postgres::ConnectionParams>(conn_params), options);
 
     return EXIT_SUCCESS;
   });
@@ -0,0 +1,63 @@
+#include <remote-build-queue/routes.hh>
+
+namespace remote_build {
+namespace queue {
+namespace routes {
+
+shared_ptr<Mailbox> Routes::subscribe(Uuid const &job) {
+  auto mailbox = std::make_shared<Mailbox>();
+
+  this->mailboxes.lock()->insert_or_assign(
+      job, Route{.mailbox = mailbox, .seq = 0});
+
+  return mailbox;
+}
+
+void Routes::forget(Uuid const &job) { this->mailboxes.lock()->erase(job); }
+
+bool Routes::deliver(event::Event const &event) {
+  shared_ptr<Mailbox> mailbox;
+
+  auto fields = event::plain(event);
+
+  {
+    auto boxes(this->mailboxes.lock());
+
+    auto found = boxes->find(fields.job);
+
+    if (found == boxes->end())
+      return false;
+
+    if (fields.seq <= found->second.seq)
+      return true;
+
+    found->second.seq = fields.seq;
+
+    mailbox = found->second.mailbox;
+  }
+
+  mailbox->push(event);
+
+  return true;
+}
+
+map<Uuid, int64_t> Routes::cursors() {
+  map<Uuid, int64_t> res;
+
+  auto boxes(this->mailboxes.lock());
+
+  for (auto &[job, route] : *boxes)
+    res.emplace(job, route.seq);
+
+  return res;
+}
+
+void Routes::resume(Uuid const &job) { this->resumed.lock()->insert(job); }
+
+bool Routes::resuming(Uuid const &job) {
+  return this->resumed.lock()->erase(job) > 0;
+}
+
+} // namespace routes
+} // namespace queue
+} // namespace remote_build
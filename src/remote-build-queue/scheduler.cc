@@ -0,0 +1,85 @@
+#include <algorithm>
+
+#include <remote-build-queue/scheduler.hh>
+
+namespace remote_build {
+namespace queue {
+namespace scheduler {
+
+map<string, Score> const policies = {
+    {"speed", score_speed},
+    {"load", score_load},
+    {"locality", score_locality},
+};
+
+double score_speed(Candidate const &candidate, job::Job const &job) {
+  return candidate.machine->speedFactor;
+}
+
+double score_load(Candidate const &candidate, job::Job const &job) {
+  // Clamp so a couple of unusually long builds cannot starve a machine
+  auto duration = std::clamp(candidate.relative_duration, 0.5, 2.0);
+
+  auto speed = candidate.machine->speedFactor / duration;
+
+  auto free = double(candidate.free_slots) /
+              std::max(candidate.machine->maxJobs, candidate.free_slots);
+
+  return speed * free /
+         (1 + 0.25 * candidate.unused_features) /
+         (1 + candidate.missing_fraction);
+}
+
+double score_locality(Candidate const &candidate, job::Job const &job) {
+  return score_load(candidate, job) / (0.05 + candidate.missing_fraction);
+}
+
+optional<Score> policy(string const &name) {
+  auto found = policies.find(name);
+
+  if (found == policies.end())
+    return std::nullopt;
+
+  return found->second;
+}
+
+optional<size_t> pick(Score score, vector<Candidate> candidates,
+                      job::Job const &job) {
+  if (candidates.empty())
+    return std::nullopt;
+
+  double total = 0;
+
+  size_t known = 0;
+
+  for (auto &c : candidates)
+    if (c.mean_build_secs) {
+      total += *c.mean_build_secs;
+
+      known++;
+    }
+
+  for (auto &c : candidates)
+    c.relative_duration = (c.mean_build_secs && total > 0)
+                              ? *c.mean_build_secs / (total / known)
+                              : 1;
+
+  vector<double> scores;
+
+  for (auto &c : candidates)
+    scores.push_back(score(c, job));
+
+  size_t best = 0;
+
+  for (size_t i = 1; i < candidates.size(); i++)
+    if (scores[i] > scores[best] ||
+        (scores[i] == scores[best] &&
+         candidates[i].slot < candidates[best].slot))
+      best = i;
+
+  return candidates[best].slot;
+}
+
+} // namespace scheduler
+} // namespace queue
+} // namespace remote_build
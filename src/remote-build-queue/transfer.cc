@@ -0,0 +1,188 @@
+#include <algorithm>
+
+#include <nix/logging.hh>
+#include <nix/util.hh>
+
+#include <remote-build-queue/copy.hh>
+#include <remote-build-queue/transfer.hh>
+
+using nix::fmt;
+using nix::logger;
+using nix::Verbosity::lvlDebug;
+using nix::Verbosity::lvlVomit;
+
+namespace remote_build {
+namespace queue {
+namespace transfer {
+
+void Scheduler::copy(string const &uri, nix::Store &remote,
+                     nix::StorePathSet const &paths,
+                     nix::SubstituteFlag substitute, Priority priority) {
+  auto valid = remote.queryValidPaths(paths, substitute);
+
+  nix::StorePathSet missing;
+
+  for (auto &path : paths)
+    if (valid.find(path) == valid.end())
+      missing.insert(path);
+
+  if (missing.empty())
+    return;
+
+  map<nix::StorePath, nix::StorePathSet> references;
+
+  for (auto &path : missing)
+    references.emplace(path, this->local->queryPathInfo(path)->references);
+
+  auto q(this->queue.lock());
+
+  vector<shared_ptr<Task>> mine;
+
+  vector<shared_ptr<Task>> fresh;
+
+  for (auto &path : missing) {
+    auto found = q->tasks.find(std::make_pair(uri, path));
+
+    if (found != q->tasks.end()) {
+      auto task = found->second;
+
+      vomit("'%s' is already on its way to '%s'", remote.printStorePath(path),
+            uri);
+
+      if (priority < task->priority) {
+        auto was_ready = q->ready.erase(task) > 0;
+
+        task->priority = priority;
+
+        if (was_ready)
+          q->ready.insert(task);
+      }
+
+      mine.push_back(task);
+
+      continue;
+    }
+
+    auto task = std::make_shared<Task>(Task{
+        .uri = uri,
+        .remote = &remote,
+        .path = path,
+        .priority = priority,
+        .seq = q->seq++,
+        .blocked_on = 0,
+        .dependents = {},
+        .done = false,
+        .error = std::nullopt,
+    });
+
+    q->tasks.emplace(std::make_pair(uri, path), task);
+
+    fresh.push_back(task);
+
+    mine.push_back(task);
+  }
+
+  for (auto &task : fresh) {
+    for (auto &ref : references.at(task->path)) {
+      auto dep = q->tasks.find(std::make_pair(uri, ref));
+
+      if (ref == task->path || dep == q->tasks.end())
+        continue;
+
+      task->blocked_on++;
+
+      dep->second->dependents.push_back(task);
+    }
+
+    if (task->blocked_on == 0)
+      q->ready.insert(task);
+  }
+
+  debug("queued %d uploads to '%s', %d already in flight", fresh.size(), uri,
+        mine.size() - fresh.size());
+
+  this->runnable.notify_all();
+
+  while (!std::all_of(mine.begin(), mine.end(),
+                      [](shared_ptr<Task> const &task) { return task->done; }))
+    q.wait(this->finished);
+
+  for (auto &task : mine)
+    if (task->error)
+      throw nix::Error("copying '%s' to '%s': %s",
+                       remote.printStorePath(task->path), uri, *task->error);
+}
+
+void Scheduler::run() {
+  while (true) {
+    shared_ptr<Task> task;
+
+    {
+      auto q(this->queue.lock());
+
+      while (true) {
+        auto eligible = std::find_if(
+            q->ready.begin(), q->ready.end(), [&](shared_ptr<Task> const &t) {
+              return q->streams[t->uri] < this->max_machine_streams;
+            });
+
+        if (eligible != q->ready.end()) {
+          task = *eligible;
+
+          q->ready.erase(eligible);
+
+          q->streams[task->uri]++;
+
+          break;
+        }
+
+        q.wait(this->runnable);
+      }
+    }
+
+    optional<string> error;
+
+    try {
+      copy::send_path(*this->local, *task->remote, task->path, this->cache);
+
+    } catch (std::exception &e) {
+      error = e.what();
+    }
+
+    auto q(this->queue.lock());
+
+    q->streams[task->uri]--;
+
+    this->finish(*q, task, error);
+
+    this->runnable.notify_all();
+
+    this->finished.notify_all();
+  }
+}
+
+void Scheduler::finish(Queue &q, shared_ptr<Task> const &task,
+                       optional<string> const &error) {
+  task->done = true;
+
+  task->error = error;
+
+  q.tasks.erase(std::make_pair(task->uri, task->path));
+
+  for (auto &dep : task->dependents) {
+    if (dep->done)
+      continue;
+
+    if (error)
+      this->finish(q, dep,
+                   fmt("reference '%s' failed: %s",
+                       this->local->printStorePath(task->path), *error));
+
+    else if (--dep->blocked_on == 0)
+      q.ready.insert(dep);
+  }
+}
+
+} // namespace transfer
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,44 @@
+#include <remote-build-queue/valid-paths.hh>
+
+namespace remote_build {
+namespace queue {
+namespace valid_paths {
+
+void ValidPaths::insert(nix::StorePathSet const &paths) {
+  if (this->ttl == Clock::duration::zero())
+    return;
+
+  auto now = Clock::now();
+
+  if (now >= this->next_prune) {
+    for (auto it = this->expiry.begin(); it != this->expiry.end();)
+      it = it->second <= now ? this->expiry.erase(it) : std::next(it);
+
+    this->next_prune = now + this->ttl;
+  }
+
+  for (auto &path : paths)
+    this->expiry.insert_or_assign(path, now + this->ttl);
+}
+
+bool ValidPaths::contains(nix::StorePath const &path) const {
+  auto found = this->expiry.find(path);
+
+  return found != this->expiry.end() && Clock::now() < found->second;
+}
+
+nix::StorePathSet ValidPaths::unknown(nix::StorePathSet const &paths) const {
+  nix::StorePathSet res;
+
+  for (auto &path : paths)
+    if (!this->contains(path))
+      res.insert(path);
+
+  return res;
+}
+
+void ValidPaths::clear() { this->expiry.clear(); }
+
+} // namespace valid_paths
+} // namespace queue
+} // namespace remote_build
@@ -0,0 +1,37 @@
+#include <vector>
+
+#include <remote-build-queue/wait-queue.hh>
+
+namespace remote_build {
+namespace queue {
+namespace wait_queue {
+
+optional<Todo> take(WaitQueue &waiting,
+                    std::function<bool(job::Job const &)> can_build) {
+  std::vector<Todo> skipped;
+
+  optional<Todo> found;
+
+  while (!waiting.empty()) {
+    auto top = waiting.top();
+
+    waiting.pop();
+
+    if (can_build(top.start.payload)) {
+      found.emplace(top);
+
+      break;
+    }
+
+    skipped.push_back(top);
+  }
+
+  for (auto &job : skipped)
+    waiting.push(job);
+
+  return found;
+}
+
+} // namespace wait_queue
+} // namespace queue
+} // namespace remote_build
@@ -1,3 +1,5 @@
+#include <chrono>
+#include <future>
 #include <memory>
 
 #include <nix/build-result.hh>
@@ -7,6 +9,7 @@
 
 #include <dequeue.hh>
 #include <job.hh>
+#include <remote-build-queue/locality.hh>
 #include <remote-build-queue/postgres.hh>
 #include <remote-build-queue/worker.hh>
 
@@ -20,83 +23,268 @@ namespace remote_build {
 namespace queue {
 namespace worker {
 
-void Worker::run(Wakeup &wakeup) {
+void Worker::run(Wakeup &wakeup, Sync<WaitQueue> &waiting,
+                 Sync<capabilities::Index> &index,
+                 transfer::Scheduler &transfers, routes::Routes &routes,
+                 std::function<void()> const &want_jobs) {
   nix::ref<nix::Store> localStore = nix::openStore();
 
   while (true) {
-    auto todo(this->todo.lock());
+    unique_ptr<event::Start> todo;
 
-    todo.wait(inbox);
+    shared_ptr<locality::Closure const> closure;
 
-    auto conn_res = postgres::connect(this->conn_params);
+    {
+      auto curr(this->todo.lock());
+
+      while (!*curr)
+        curr.wait(inbox);
+
+      todo = std::make_unique<event::Start>((*curr)->start);
+
+      closure = (*curr)->closure;
+    }
+
+    // Whatever goes wrong with one job must not take the slot with it
+    try {
+      auto err = this->build(*todo, *closure, localStore, transfers, routes);
+
+      if (err)
+        return die(wakeup, *err);
+
+    } catch (std::exception &e) {
+      printError("building %s on '%s': %s", todo->job.to_string(),
+                 this->machine->storeUri, e.what());
+
+      routes.forget(todo->job);
+
+      auto conn_res = this->db.get();
+
+      if (std::holds_alternative<string>(conn_res))
+        return die(wakeup, get<string>(conn_res));
+
+      auto fail_res = fail_job(get<shared_ptr<PGconn>>(conn_res).get(),
+                               todo->job, e.what());
+
+      if (std::holds_alternative<string>(fail_res))
+        return die(wakeup, get<string>(fail_res));
+    }
+
+    {
+      auto queued(waiting.lock());
+
+      auto idx(index.lock());
+
+      auto curr(this->todo.lock());
+
+      auto next = wait_queue::take(*queued, [&](job::Job const &job) {
+        return idx->can_build(this->id, job);
+      });
+
+      if (next) {
+        debug("'%s' taking waiting job %s", this->machine->storeUri,
+              next->start.job.to_string());
+
+        *curr = std::make_unique<wait_queue::Todo>(*next);
+
+      } else {
+        debug("emptying inbox of '%s' slot %d", this->machine->storeUri,
+              this->slot);
+
+        curr->reset();
+
+        idx->set_idle(this->id);
+
+        this->builder->occupied--;
+      }
+    }
+
+    // Pending jobs need not wait for the next claim round to fill the gap
+    want_jobs();
+  }
+}
+
+optional<string> Worker::build(event::Start const &todo,
+                               locality::Closure const &closure,
+                               nix::ref<nix::Store> localStore,
+                               transfer::Scheduler &transfers,
+                               routes::Routes &routes) {
+  // Uploads for jobs taken earlier go first
+  auto since = std::chrono::steady_clock::now();
+
+  auto substitute = nix::settings.buildersUseSubstitutes ? nix::Substitute
+                                                         : nix::NoSubstitute;
+
+  // Start on the inputs that are already built while the hook is still
+  // deciding. add-inputs-and-outputs then only has to fill the gap.
+  nix::StorePathSet prefetched;
+
+  for (auto &[path, size] : closure)
+    prefetched.insert(path);
+
+  prefetched = this->builder->valid_paths.lock()->unknown(prefetched);
+
+  auto prefetch = std::async(std::launch::async, [&]() {
+    if (prefetched.empty())
+      return;
+
+    transfers.copy(this->machine->storeUri, *this->store, prefetched,
+                   substitute, since);
+  });
+
+  // Before accepting, so the hook's answer cannot slip past us
+  auto mailbox = routes.subscribe(todo.job);
+
+  {
+    auto conn_res = this->db.get();
 
     if (std::holds_alternative<string>(conn_res))
-      return die(wakeup, get<string>(conn_res));
+      return get<string>(conn_res);
+
+    auto conn = get<shared_ptr<PGconn>>(conn_res).get();
 
-    auto listen_res =
-        dequeue::listen_channel(this->conn_params, todo->get()->job.val);
+    // Taken over from a daemon that went away: what the hook sent it
+    // was heard there, not here.
+    if (routes.resuming(todo.job)) {
+      auto history = dequeue::get_events(conn, todo.job);
 
-    if (std::holds_alternative<string>(listen_res))
-      return die(wakeup, get<string>(listen_res));
+      if (std::holds_alternative<string>(history))
+        return get<string>(history);
 
-    auto events = get<dequeue::Events>(listen_res);
+      // Through routes, so that those also heard live are dropped
+      for (auto &queued = get<std::queue<dequeue::ListenResult>>(history);
+           !queued.empty(); queued.pop())
+        if (std::holds_alternative<event::Event>(queued.front()))
+          routes.deliver(get<event::Event>(queued.front()));
+    }
 
-    auto accept_res =
-        accept_job(this->conn.get(), todo->get()->job, this->machine->storeUri);
+    auto accept_res = accept_job(conn, todo.job, this->machine->storeUri);
 
     if (std::holds_alternative<string>(accept_res))
-      return die(wakeup, get<string>(accept_res));
+      return get<string>(accept_res);
+  }
 
-    shared_ptr<event::AddInputsAndOutputs> inputs_outputs;
+  shared_ptr<event::AddInputsAndOutputs> inputs_outputs;
 
-    auto events_iter = events.begin();
+  while (true) {
+    auto event = mailbox->pop();
 
-    while (true) {
-      if (std::holds_alternative<dequeue::Error>(*events_iter->curr))
-        return die(wakeup,
-                   dequeue::err_msg(get<dequeue::Error>(*events_iter->curr)));
+    vomit("%s got event %s", this->machine->storeUri, event::plain(event).name);
 
-      auto event = get<event::Event>(*events_iter->curr);
+    if (std::holds_alternative<event::AddInputsAndOutputs>(event)) {
+      inputs_outputs = std::make_shared<event::AddInputsAndOutputs>(
+          get<event::AddInputsAndOutputs>(event));
 
-      vomit("%s got event %s", this->machine->storeUri,
-            event::plain(event).name);
+      goto dependencies_known;
+    }
 
-      if (std::holds_alternative<event::AddInputsAndOutputs>(event)) {
-        inputs_outputs = std::make_shared<event::AddInputsAndOutputs>(
-            get<event::AddInputsAndOutputs>(event));
+    // Canceled, or finished elsewhere, before the hook sent the inputs
+    if (!std::holds_alternative<event::Accept>(event) &&
+        !std::holds_alternative<event::Start>(event)) {
+      debug("%s ended before its inputs arrived", todo.job.to_string());
 
-        goto dependencies_known;
-      }
+      routes.forget(todo.job);
+
+      return std::nullopt;
+    }
+  }
+
+dependencies_known:
+
+  routes.forget(todo.job);
+
+  try {
+    prefetch.get();
+
+    this->builder->valid_paths.lock()->insert(prefetched);
+
+  } catch (nix::Error &e) {
+    debug("prefetching inputs of %s: %s", todo.job.to_string(), e.what());
+  }
+
+  debug("copying dependencies to '%s'", this->machine->storeUri);
+
+  auto &inputs = inputs_outputs->payload.inputs;
 
-      ++events_iter;
+  auto unknown = this->builder->valid_paths.lock()->unknown(inputs);
+
+  debug("%d of %d inputs not known to be valid on '%s'", unknown.size(),
+        inputs.size(), this->machine->storeUri);
+
+  if (!unknown.empty())
+    try {
+      transfers.copy(this->machine->storeUri, *this->store, unknown,
+                     substitute, since);
+
+    } catch (nix::Error &e) {
+      // Likely a path we assumed valid was garbage collected
+      debug("forgetting valid paths of '%s': %s", this->machine->storeUri,
+            e.what());
+
+      this->builder->valid_paths.lock()->clear();
+
+      transfers.copy(this->machine->storeUri, *this->store, inputs,
+                     substitute, since);
     }
 
-  dependencies_known:
+  this->builder->valid_paths.lock()->insert(inputs);
+
+  // TODO: Figure out the distributed case
+  auto drv_path = nix::StorePath(todo.payload.drv);
+
+  auto drv = localStore->readDerivation(drv_path);
+
+  auto output_hashes = staticOutputHashes(*localStore, drv);
+
+  if (!drv.inputDrvs.empty())
+    drv.inputSrcs = inputs_outputs->payload.inputs;
 
-    debug("copying dependencies to '%s'", this->machine->storeUri);
+  auto build_start = std::chrono::steady_clock::now();
 
-    auto substitute = nix::settings.buildersUseSubstitutes ? nix::Substitute
-                                                           : nix::NoSubstitute;
+  auto result = this->store->buildDerivation(drv_path, drv);
 
-    copyPaths(*localStore, *this->store, inputs_outputs->payload.inputs,
-              nix::NoRepair, nix::NoCheckSigs, substitute);
+  this->builder->record_build(std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() -
+                                  build_start)
+                                  .count());
 
-    // TODO: Figure out the distributed case
-    auto drv_path = nix::StorePath(todo->get()->payload.drv);
+  if (result.success()) {
+    nix::StorePathSet outputs;
 
-    auto drv = localStore->readDerivation(drv_path);
+    for (auto &[name, output] : drv.outputsAndOptPaths(*localStore))
+      if (output.second)
+        outputs.insert(*output.second);
 
-    auto output_hashes = staticOutputHashes(*localStore, drv);
+    this->builder->valid_paths.lock()->insert(outputs);
+  }
+
+  {
+    auto conn_res = this->db.get();
 
-    if (!drv.inputDrvs.empty())
-      drv.inputSrcs = inputs_outputs->payload.inputs;
+    if (std::holds_alternative<string>(conn_res))
+      return get<string>(conn_res);
 
-    auto result = this->store->buildDerivation(drv_path, drv);
+    auto conn = get<shared_ptr<PGconn>>(conn_res).get();
 
-    debug("emptying inbox of '%s'", this->machine->storeUri);
+    auto finish_res = result.success()
+                          ? succeed_job(conn, todo.job)
+                          : fail_job(conn, todo.job, result.errorMsg);
 
-    todo->reset();
+    if (std::holds_alternative<string>(finish_res))
+      return get<string>(finish_res);
   }
+
+  return std::nullopt;
+
+}
+
+void Worker::assign(Sync<unique_ptr<wait_queue::Todo>>::Lock &curr,
+                    wait_queue::Todo const &next) {
+  *curr = std::make_unique<wait_queue::Todo>(next);
+
+  this->builder->occupied++;
+
+  this->inbox.notify_one();
 }
 
 void Worker::die(Wakeup &wakeup, nix::Error e) {